@@ -5,276 +5,3158 @@
 #pragma once
 
 #include <utility>
+#include <algorithm>
 #include <vector>
+#include <array>
 #include <string>
+#include <string_view>
+#include <optional>
 #include <memory>
+#include <memory_resource>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <new>
+#include <bit>
+#include <charconv>
+#include <chrono>
+#include <functional>
+#include <type_traits>
+#include <concepts>
 #include <unordered_map>
+#include <unordered_set>
+#include <deque>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <stop_token>
 #include <ranges>
-#include <iostream>
+#include <span>
+#include <cstdio>
+#include <cstring>
 
 namespace CSS {
-    using PropertyTable = std::unordered_map<std::string, std::string>;
-    using Stylesheet    = std::unordered_map<std::string, PropertyTable>;
+    // Transparent hash so the tables can be searched with a `std::string_view` (or string
+    // literal) without materializing a temporary `std::string` key.
+    struct StringHash {
+        using is_transparent = void;
 
+        size_t operator()(std::string_view str) const noexcept {
+            return std::hash<std::string_view> {}(str);
+        }
+    };
+
+    // Where a declaration comes from. Among normal declarations later origins win;
+    // `!important` declarations beat all normal ones and reverse the order.
+    enum class Origin : uint8_t {
+        Default,  // library defaults (the user-agent origin in CSS terms)
+        User,
+        Author,
+    };
+
+    // Precedence of a declaration in the cascade. One with the same or a higher rank replaces
+    // an existing declaration of the same property.
+    constexpr int CascadeRank(Origin origin, bool important) noexcept {
+        const int rank = static_cast<int>(origin);
+        return important ? 5 - rank : rank;
+    }
+
+    // Everything the parser produces is allocated from a `std::pmr::memory_resource` (see
+    // `ParseOptions::resource`), which the stylesheet, its tables and their strings pass on
+    // to each other through the usual uses-allocator construction.
+    struct Declaration {
+        using allocator_type = std::pmr::polymorphic_allocator<>;
+
+        Declaration(std::string_view property, std::string_view value, allocator_type alloc = {})
+            : property(property, alloc), value(value, alloc) {}
+
+        Declaration(const Declaration& other, allocator_type alloc = {})
+            : property(other.property, alloc), value(other.value, alloc), origin(other.origin),
+              important(other.important) {}
+
+        Declaration(Declaration&&) noexcept = default;
+
+        Declaration(Declaration&& other, allocator_type alloc)
+            : property(std::move(other.property), alloc), value(std::move(other.value), alloc),
+              origin(other.origin), important(other.important) {}
+
+        Declaration& operator=(const Declaration&) = default;
+        Declaration& operator=(Declaration&&)      = default;
+
+        std::pmr::string property;
+        std::pmr::string value;
+        Origin origin  = Origin::Author;
+        bool important = false;
+    };
+
+    // Declarations of a single rule, kept in insertion order. Blocks with up to
+    // `InlineCapacity` declarations live entirely inside the table and are searched by
+    // comparing 32-bit property hashes; larger blocks spill to a heap block, which gets an
+    // open-addressing index once it holds more than `LinearSearchMax` declarations.
+    class PropertyTable {
+    public:
+        static constexpr size_t InlineCapacity = 4;
+
+        using value_type     = Declaration;
+        using iterator       = Declaration*;
+        using const_iterator = const Declaration*;
+        using allocator_type = std::pmr::polymorphic_allocator<>;
+
+        PropertyTable() noexcept = default;
+
+        explicit PropertyTable(allocator_type alloc) noexcept : alloc(alloc) {}
+
+        PropertyTable(const PropertyTable& other, allocator_type alloc = {})
+            : PropertyTable(alloc) {
+            copyFrom(other);
+        }
+
+        PropertyTable(PropertyTable&& other) noexcept : PropertyTable(other.get_allocator()) {
+            moveFrom(other);
+        }
+
+        PropertyTable(PropertyTable&& other, allocator_type alloc) : PropertyTable(alloc) {
+            if (alloc == other.get_allocator()) {
+                moveFrom(other);
+            } else {
+                copyFrom(other);
+            }
+        }
+
+        // Like the standard containers, tables keep their own memory resource on assignment.
+        PropertyTable& operator=(const PropertyTable& other) {
+            if (this != &other) {
+                clear();
+                copyFrom(other);
+            }
+            return *this;
+        }
+
+        PropertyTable& operator=(PropertyTable&& other) {
+            if (this == &other) { return *this; }
+
+            if (get_allocator() != other.get_allocator()) {
+                clear();
+                copyFrom(other);
+                return *this;
+            }
+
+            destroyInline();
+            freeHeap();
+            moveFrom(other);
+            return *this;
+        }
+
+        ~PropertyTable() {
+            destroyInline();
+            freeHeap();
+        }
+
+        [[nodiscard]] size_t size() const noexcept {
+            return heap ? heap->declarations.size() : inlineCount;
+        }
+
+        [[nodiscard]] bool empty() const noexcept {
+            return size() == 0;
+        }
+
+        iterator begin() noexcept {
+            return data();
+        }
+
+        iterator end() noexcept {
+            return data() + size();
+        }
+
+        [[nodiscard]] const_iterator begin() const noexcept {
+            return data();
+        }
+
+        [[nodiscard]] const_iterator end() const noexcept {
+            return data() + size();
+        }
+
+        [[nodiscard]] const_iterator find(std::string_view property) const noexcept {
+            const size_t i = indexOf(property, Hash(property));
+            return i != npos ? data() + i : end();
+        }
+
+        iterator find(std::string_view property) noexcept {
+            const size_t i = indexOf(property, Hash(property));
+            return i != npos ? data() + i : end();
+        }
+
+        [[nodiscard]] bool contains(std::string_view property) const noexcept {
+            return find(property) != end();
+        }
+
+        // Inserts an empty value if `property` isn't present yet.
+        std::pmr::string& operator[](std::string_view property) {
+            const uint32_t hash = Hash(property);
+            const size_t i      = indexOf(property, hash);
+            return i != npos ? data()[i].value : append(hash, property, {}, nullptr).value;
+        }
+
+        // Inserts or overwrites `property`, keeping its original position.
+        void set(std::string_view property, std::string_view value) {
+            const uint32_t hash = Hash(property);
+            if (const size_t i = indexOf(property, hash); i != npos) {
+                data()[i].value.assign(value);
+            } else {
+                append(hash, property, value, nullptr);
+            }
+        }
+
+        // Adds a declaration the way the cascade would: an existing one for `property` is
+        // only replaced if it doesn't outrank the new one (see `CascadeRank`). Returns
+        // whether the declaration was applied.
+        bool cascade(std::string_view property,
+                     std::string_view value,
+                     Origin origin,
+                     bool important) {
+            return cascade(Hash(property), property, value, origin, important, nullptr);
+        }
+
+        // Same, but a new declaration is assigned into the back of `spare` (see
+        // `clear(spare)`) when there is one, which only allocates if its strings are too short.
+        bool cascade(std::string_view property,
+                     std::string_view value,
+                     Origin origin,
+                     bool important,
+                     std::pmr::vector<Declaration>& spare) {
+            return cascade(Hash(property), property, value, origin, important, &spare);
+        }
+
+        // Applies `other` on top of this table, as a later sheet in the cascade: its
+        // declarations win unless an existing one outranks them, and properties already
+        // present keep their position. The property hashes stored in `other` are reused.
+        void merge(const PropertyTable& other) {
+            const Declaration* declarations = other.data();
+            for (size_t i = 0; i < other.size(); i++) {
+                const auto& [property, value, origin, important] = declarations[i];
+                cascade(other.hashAt(i), property, value, origin, important, nullptr);
+            }
+        }
+
+        void reserve(size_t count) {
+            if (count <= InlineCapacity && !heap) { return; }
+
+            spill(count);
+            if (count > LinearSearchMax) { rebuildIndex(count); }
+        }
+
+        [[nodiscard]] allocator_type get_allocator() const noexcept {
+            return alloc;
+        }
+
+        // Drops all declarations, keeping any heap capacity.
+        void clear() noexcept {
+            destroyInline();
+            if (heap) { heap->clear(); }
+        }
+
+        // Same, but moves the declarations to the back of `spare`, last first, so that
+        // `cascade(..., spare)` reuses their strings in their original order.
+        void clear(std::pmr::vector<Declaration>& spare) {
+            spare.reserve(spare.size() + size());
+            Declaration* declarations = data();
+            for (size_t i = size(); i > 0; i--) {
+                spare.push_back(std::move(declarations[i - 1]));
+            }
+            clear();
+        }
+
+    private:
+        static constexpr size_t npos = SIZE_MAX;
+
+        // Spilled tables up to this size are searched like inline ones, without an index.
+        static constexpr size_t LinearSearchMax = 8;
+
+        // Only allocated once a table outgrows its inline storage, so that tables that never
+        // do stay small.
+        struct Heap {
+            explicit Heap(allocator_type alloc)
+                : declarations(alloc), hashes(alloc), index(alloc) {}
+
+            void clear() noexcept {
+                declarations.clear();
+                hashes.clear();
+                std::fill(index.begin(), index.end(), 0);
+            }
+
+            std::pmr::vector<Declaration> declarations;
+            std::pmr::vector<uint32_t> hashes;
+            std::pmr::vector<uint32_t> index;  // slot -> declaration index + 1, 0 = empty
+        };
+
+        alignas(Declaration) std::byte inlineStorage[InlineCapacity * sizeof(Declaration)];
+        std::array<uint32_t, InlineCapacity> inlineHashes {};
+        uint32_t inlineCount = 0;
+        allocator_type alloc;
+        Heap* heap = nullptr;  // non-null once spilled
+
+        static uint32_t Hash(std::string_view property) noexcept {
+            return static_cast<uint32_t>(std::hash<std::string_view> {}(property));
+        }
+
+        Declaration* inlineData() noexcept {
+            return std::launder(reinterpret_cast<Declaration*>(inlineStorage));
+        }
+
+        [[nodiscard]] const Declaration* inlineData() const noexcept {
+            return std::launder(reinterpret_cast<const Declaration*>(inlineStorage));
+        }
+
+        Declaration* data() noexcept {
+            return heap ? heap->declarations.data() : inlineData();
+        }
+
+        [[nodiscard]] const Declaration* data() const noexcept {
+            return heap ? heap->declarations.data() : inlineData();
+        }
+
+        [[nodiscard]] uint32_t hashAt(size_t i) const noexcept {
+            return heap ? heap->hashes[i] : inlineHashes[i];
+        }
+
+        [[nodiscard]] size_t indexOf(std::string_view property, uint32_t hash) const noexcept {
+            const Declaration* declarations = data();
+
+            if (!heap) {
+                // Branch-free compare of all inline hashes, then only check the candidates.
+                uint32_t candidates = 0;
+                for (size_t i = 0; i < InlineCapacity; i++) {
+                    candidates |= static_cast<uint32_t>(inlineHashes[i] == hash) << i;
+                }
+                candidates &= (1u << inlineCount) - 1;
+
+                while (candidates) {
+                    const size_t i = std::countr_zero(candidates);
+                    if (declarations[i].property == property) { return i; }
+                    candidates &= candidates - 1;
+                }
+                return npos;
+            }
+
+            const auto& hashes = heap->hashes;
+            const auto& index  = heap->index;
+            if (hashes.size() <= LinearSearchMax || index.empty()) {
+                for (size_t i = 0; i < hashes.size(); i++) {
+                    if (hashes[i] == hash && declarations[i].property == property) { return i; }
+                }
+                return npos;
+            }
+
+            const size_t mask = index.size() - 1;
+            for (size_t slot = hash & mask;; slot = (slot + 1) & mask) {
+                const uint32_t entry = index[slot];
+                if (entry == 0) { return npos; }
+
+                const size_t i = entry - 1;
+                if (hashes[i] == hash && declarations[i].property == property) { return i; }
+            }
+        }
+
+        Declaration& append(uint32_t hash,
+                            std::string_view property,
+                            std::string_view value,
+                            std::pmr::vector<Declaration>* spare) {
+            const bool reuse = spare && !spare->empty();
+
+            if (!heap && inlineCount < InlineCapacity) {
+                Declaration* declaration = inlineData() + inlineCount;
+                if (reuse) {
+                    new (declaration) Declaration(recycle(*spare, property, value));
+                } else {
+                    new (declaration) Declaration(property, value, alloc);
+                }
+                inlineHashes[inlineCount++] = hash;
+                return *declaration;
+            }
+
+            if (!heap) { spill(InlineCapacity * 2); }
+            auto& declarations = heap->declarations;
+            if (reuse) {
+                declarations.push_back(recycle(*spare, property, value));
+            } else {
+                declarations.emplace_back(property, value);
+            }
+            heap->hashes.push_back(hash);
+
+            if (declarations.size() > LinearSearchMax || !heap->index.empty()) {
+                if (declarations.size() * 2 > heap->index.size()) {
+                    rebuildIndex(declarations.size());
+                } else {
+                    insertIndex(declarations.size() - 1);
+                }
+            }
+            return declarations.back();
+        }
+
+        // Moves the inline declarations to the heap block, allocating it on first use.
+        void spill(size_t capacity) {
+            if (!heap) { heap = alloc.new_object<Heap>(alloc); }
+
+            auto& declarations = heap->declarations;
+            declarations.reserve(std::max<size_t>(capacity, inlineCount));
+            heap->hashes.reserve(declarations.capacity());
+
+            for (uint32_t i = 0; i < inlineCount; i++) {
+                declarations.push_back(std::move(inlineData()[i]));
+                heap->hashes.push_back(inlineHashes[i]);
+            }
+            destroyInline();
+        }
+
+        void rebuildIndex(size_t count) {
+            heap->index.assign(std::bit_ceil(std::max<size_t>(count * 2, LinearSearchMax * 2)), 0);
+            for (size_t i = 0; i < heap->declarations.size(); i++) {
+                insertIndex(i);
+            }
+        }
+
+        void insertIndex(size_t i) noexcept {
+            auto& index       = heap->index;
+            const size_t mask = index.size() - 1;
+            size_t slot       = heap->hashes[i] & mask;
+            while (index[slot] != 0) {
+                slot = (slot + 1) & mask;
+            }
+            index[slot] = static_cast<uint32_t>(i + 1);
+        }
+
+        // Takes the last spare declaration and assigns into its strings, which only allocates
+        // if they are too short.
+        static Declaration recycle(std::pmr::vector<Declaration>& spare,
+                                   std::string_view property,
+                                   std::string_view value) {
+            Declaration declaration = std::move(spare.back());
+            spare.pop_back();
+            declaration.property.assign(property);
+            declaration.value.assign(value);
+            declaration.origin    = Origin::Author;
+            declaration.important = false;
+            return declaration;
+        }
+
+        void destroyInline() noexcept {
+            std::destroy_n(inlineData(), inlineCount);
+            inlineCount = 0;
+        }
+
+        void freeHeap() noexcept {
+            if (heap) {
+                alloc.delete_object(heap);
+                heap = nullptr;
+            }
+        }
+
+        bool cascade(uint32_t hash,
+                     std::string_view property,
+                     std::string_view value,
+                     Origin origin,
+                     bool important,
+                     std::pmr::vector<Declaration>* spare) {
+            Declaration* declaration;
+            if (const size_t i = indexOf(property, hash); i != npos) {
+                declaration = data() + i;
+                if (CascadeRank(declaration->origin, declaration->important) >
+                    CascadeRank(origin, important)) {
+                    return false;
+                }
+                declaration->value.assign(value);
+            } else {
+                declaration = &append(hash, property, value, spare);
+            }
+            declaration->origin    = origin;
+            declaration->important = important;
+            return true;
+        }
+
+        void copyFrom(const PropertyTable& other) {
+            reserve(other.size());
+            const Declaration* declarations = other.data();
+            for (size_t i = 0; i < other.size(); i++) {
+                Declaration& copy = append(other.hashAt(i), declarations[i].property,
+                                           declarations[i].value, nullptr);
+                copy.origin       = declarations[i].origin;
+                copy.important    = declarations[i].important;
+            }
+        }
+
+        // Both tables must use the same allocator, and this one must be empty without a heap
+        // block.
+        void moveFrom(PropertyTable& other) noexcept {
+            if (other.heap) {
+                heap       = other.heap;
+                other.heap = nullptr;
+                return;
+            }
+
+            for (uint32_t i = 0; i < other.inlineCount; i++) {
+                new (inlineData() + i) Declaration(std::move(other.inlineData()[i]));
+            }
+            inlineHashes = other.inlineHashes;
+            inlineCount  = other.inlineCount;
+            other.destroyInline();
+        }
+    };
+
+    // Rules in source order (where each selector first appeared), stored contiguously, with
+    // an open-addressing index from selector hash to position on top. Iteration walks the
+    // rules in order; lookups behave like an unordered map. Don't change a selector through
+    // an iterator, the index wouldn't know about it.
+    class Stylesheet {
+    public:
+        using key_type       = std::pmr::string;
+        using mapped_type    = PropertyTable;
+        using value_type     = std::pair<std::pmr::string, PropertyTable>;
+        using iterator       = std::pmr::vector<value_type>::iterator;
+        using const_iterator = std::pmr::vector<value_type>::const_iterator;
+        using allocator_type = std::pmr::polymorphic_allocator<>;
+
+        Stylesheet() = default;
+
+        explicit Stylesheet(allocator_type alloc) : rules(alloc), hashes(alloc), index(alloc) {}
+
+        Stylesheet(const Stylesheet& other, allocator_type alloc = {})
+            : rules(other.rules, alloc), hashes(other.hashes, alloc), index(other.index, alloc) {}
+
+        Stylesheet(Stylesheet&&) noexcept = default;
+
+        Stylesheet(Stylesheet&& other, allocator_type alloc)
+            : rules(std::move(other.rules), alloc), hashes(std::move(other.hashes), alloc),
+              index(std::move(other.index), alloc) {}
+
+        Stylesheet& operator=(const Stylesheet&) = default;
+        Stylesheet& operator=(Stylesheet&&)      = default;
+
+        [[nodiscard]] size_t size() const noexcept {
+            return rules.size();
+        }
+
+        [[nodiscard]] bool empty() const noexcept {
+            return rules.empty();
+        }
+
+        iterator begin() noexcept {
+            return rules.begin();
+        }
+
+        iterator end() noexcept {
+            return rules.end();
+        }
+
+        [[nodiscard]] const_iterator begin() const noexcept {
+            return rules.begin();
+        }
+
+        [[nodiscard]] const_iterator end() const noexcept {
+            return rules.end();
+        }
+
+        [[nodiscard]] const_iterator find(std::string_view selector) const noexcept {
+            const size_t i = indexOf(selector, Hash(selector));
+            return i != npos ? rules.begin() + i : rules.end();
+        }
+
+        iterator find(std::string_view selector) noexcept {
+            const size_t i = indexOf(selector, Hash(selector));
+            return i != npos ? rules.begin() + i : rules.end();
+        }
+
+        [[nodiscard]] bool contains(std::string_view selector) const noexcept {
+            return find(selector) != end();
+        }
+
+        // Inserts an empty rule if `selector` isn't present yet.
+        PropertyTable& operator[](std::string_view selector) {
+            return try_emplace(selector).first->second;
+        }
+
+        // Appends an empty rule unless `selector` is present. Returns the rule and whether
+        // it was inserted.
+        std::pair<iterator, bool> try_emplace(std::string_view selector) {
+            const size_t hash = Hash(selector);
+            if (const size_t i = indexOf(selector, hash); i != npos) {
+                return {rules.begin() + i, false};
+            }
+
+            rules.emplace_back(std::piecewise_construct,
+                               std::forward_as_tuple(selector),
+                               std::forward_as_tuple());
+            return {append(hash), true};
+        }
+
+        // Appends `rule` unless its selector is present, in which case `rule` is left alone.
+        std::pair<iterator, bool> insert(value_type&& rule) {
+            const size_t hash = Hash(rule.first);
+            if (const size_t i = indexOf(rule.first, hash); i != npos) {
+                return {rules.begin() + i, false};
+            }
+
+            rules.push_back(std::move(rule));
+            return {append(hash), true};
+        }
+
+        // Applies `other` on top of this stylesheet, as a later layer of the cascade: its
+        // declarations win unless outranked (see `PropertyTable::merge`), new rules are
+        // appended in its source order. Selector and property hashes are taken from `other`
+        // rather than recomputed.
+        void merge(const Stylesheet& other) {
+            if (&other == this) { return; }
+
+            for (size_t i = 0; i < other.rules.size(); i++) {
+                const auto& [selector, properties] = other.rules[i];
+                const size_t hash                  = other.hashes[i];
+                if (const size_t j = indexOf(selector, hash); j != npos) {
+                    rules[j].second.merge(properties);
+                } else {
+                    rules.push_back(other.rules[i]);
+                    append(hash);
+                }
+            }
+        }
+
+        // Keeps the order of the remaining rules, so this is linear in their number.
+        size_t erase(std::string_view selector) {
+            const size_t i = indexOf(selector, Hash(selector));
+            if (i == npos) { return 0; }
+
+            rules.erase(rules.begin() + i);
+            hashes.erase(hashes.begin() + i);
+            rebuildIndex(rules.size());
+            return 1;
+        }
+
+        // Moves all rules to the end of `out` (e.g. to reuse their strings and tables) and
+        // leaves the stylesheet empty.
+        void extractAll(std::pmr::vector<value_type>& out) {
+            for (auto& rule : rules) {
+                out.push_back(std::move(rule));
+            }
+            clear();
+        }
+
+        void reserve(size_t count) {
+            rules.reserve(count);
+            hashes.reserve(count);
+            if (count * 2 > index.size()) { rebuildIndex(count); }
+        }
+
+        void clear() noexcept {
+            rules.clear();
+            hashes.clear();
+            std::fill(index.begin(), index.end(), 0);
+        }
+
+        [[nodiscard]] allocator_type get_allocator() const noexcept {
+            return rules.get_allocator();
+        }
+
+    private:
+        static constexpr size_t npos = SIZE_MAX;
+
+        std::pmr::vector<value_type> rules;
+        std::pmr::vector<size_t> hashes;   // StringHash of each selector
+        std::pmr::vector<uint32_t> index;  // slot -> rule index + 1, 0 = empty
+
+        static size_t Hash(std::string_view selector) noexcept {
+            return StringHash {}(selector);
+        }
+
+        [[nodiscard]] size_t indexOf(std::string_view selector, size_t hash) const noexcept {
+            if (index.empty()) { return npos; }
+
+            const size_t mask = index.size() - 1;
+            for (size_t slot = hash & mask;; slot = (slot + 1) & mask) {
+                const uint32_t entry = index[slot];
+                if (entry == 0) { return npos; }
+
+                const size_t i = entry - 1;
+                if (hashes[i] == hash && rules[i].first == selector) { return i; }
+            }
+        }
+
+        // Indexes the rule that was just pushed.
+        iterator append(size_t hash) {
+            hashes.push_back(hash);
+            if (rules.size() * 2 > index.size()) {
+                rebuildIndex(rules.size());
+            } else {
+                insertIndex(rules.size() - 1);
+            }
+            return rules.end() - 1;
+        }
+
+        void rebuildIndex(size_t count) {
+            index.assign(std::bit_ceil(std::max<size_t>(count * 2, 16)), 0);
+            for (size_t i = 0; i < rules.size(); i++) {
+                insertIndex(i);
+            }
+        }
+
+        void insertIndex(size_t i) noexcept {
+            const size_t mask = index.size() - 1;
+            size_t slot       = hashes[i] & mask;
+            while (index[slot] != 0) {
+                slot = (slot + 1) & mask;
+            }
+            index[slot] = static_cast<uint32_t>(i + 1);
+        }
+    };
+
+    namespace Detail {
+        // Input text shared by a parser and the errors it reports, so an error can point at
+        // its line without a copy of the input. Lines are only indexed once an error asks.
+        class Source {
+        public:
+            explicit Source(std::pmr::memory_resource* resource)
+                : buffer(resource), lineStarts(resource) {}
+
+            // Stores `text` followed by `padding` '\0' bytes.
+            void assign(std::string_view text, size_t padding) {
+                buffer.resize(text.size() + padding);
+                std::copy(text.begin(), text.end(), buffer.begin());
+                std::fill(buffer.begin() + static_cast<ptrdiff_t>(text.size()), buffer.end(), '\0');
+                length = text.size();
+
+                std::lock_guard lock(mutex);
+                lineStarts.clear();
+            }
+
+            [[nodiscard]] std::string_view text() const noexcept {
+                return {buffer.data(), length};
+            }
+
+            [[nodiscard]] size_t size() const noexcept {
+                return length;
+            }
+
+            [[nodiscard]] size_t capacity() const noexcept {
+                return buffer.capacity();
+            }
+
+            struct Location {
+                size_t line;    // 1-based
+                size_t column;  // 1-based, in bytes
+                std::string_view lineText;
+            };
+
+            [[nodiscard]] Location locate(size_t offset) const {
+                std::lock_guard lock(mutex);
+                const std::string_view input = text();
+                if (lineStarts.empty()) {
+                    lineStarts.push_back(0);
+                    for (size_t i = input.find('\n'); i != std::string_view::npos;
+                         i = input.find('\n', i + 1)) {
+                        lineStarts.push_back(i + 1);
+                    }
+                }
+
+                offset          = std::min(offset, length);
+                const auto next = std::upper_bound(lineStarts.begin(), lineStarts.end(), offset);
+                const size_t start = *(next - 1);
+                size_t end         = next != lineStarts.end() ? *next - 1 : length;
+                if (end > start && input[end - 1] == '\r') { end--; }
+
+                const auto line = static_cast<size_t>(next - lineStarts.begin());
+                return {line, offset - start + 1, input.substr(start, end - start)};
+            }
+
+        private:
+            std::pmr::string buffer;
+            size_t length = 0;
+
+            mutable std::mutex mutex;
+            mutable std::pmr::vector<size_t> lineStarts;  // built by the first `locate()`
+        };
+    }  // namespace Detail
+
+    // An error stores only where it happened; the line and column are worked out when asked
+    // for. It keeps the input alive, so it can outlive the parser that reported it.
     struct ParseError {
         ParseError() = default;
 
-        explicit ParseError(std::string msg, std::string line)
-            : errMsg(std::move(msg)), errLine(std::move(line)) {}
+        ParseError(std::string msg, size_t offset, std::shared_ptr<const Detail::Source> source)
+            : errMsg(std::move(msg)), errOffset(offset), source(std::move(source)) {}
+
+        // 0 if the error isn't tied to an input.
+        [[nodiscard]] size_t getLine() const {
+            return source ? source->locate(errOffset).line : 0;
+        }
+
+        [[nodiscard]] size_t getColumn() const {
+            return source ? source->locate(errOffset).column : 0;
+        }
+
+        // The whole line containing the error, without its line break.
+        [[nodiscard]] std::string_view getLineText() const {
+            return source ? source->locate(errOffset).lineText : std::string_view {};
+        }
+
+        void print() const {
+            if (!source) {
+                fprintf(stderr, "ParseError: %s\n", errMsg.c_str());
+                return;
+            }
+
+            // Long (e.g. minified) lines are cut down to the part around the error.
+            static constexpr size_t Context = 60;
+
+            const auto [line, column, lineText] = source->locate(errOffset);
+            const size_t from                   = column - 1 - std::min(column - 1, Context);
+            const std::string_view excerpt      = lineText.substr(from, Context * 2);
+            fprintf(stderr,
+                    "ParseError at line %zu, column %zu:\n\n> %.*s\n> %*s^\n\nError: %s\n",
+                    line,
+                    column,
+                    static_cast<int>(excerpt.size()),
+                    excerpt.data(),
+                    static_cast<int>(column - 1 - from),
+                    "",
+                    errMsg.c_str());
+        }
+
+        std::string errMsg;
+        size_t errOffset = 0;  // bytes from the start of the input
+
+    private:
+        std::shared_ptr<const Detail::Source> source;
+    };
+
+    // Read-only lookups. Unlike `operator[]` these never insert on a miss, so they can be
+    // called concurrently from any number of threads as long as nobody is writing to the
+    // stylesheet at the same time.
+    inline const PropertyTable* FindRule(const Stylesheet& stylesheet,
+                                         std::string_view selector) noexcept {
+        const auto it = stylesheet.find(selector);
+        return it != stylesheet.end() ? &it->second : nullptr;
+    }
+
+    inline const std::pmr::string* FindProperty(const Stylesheet& stylesheet,
+                                                std::string_view selector,
+                                                std::string_view property) noexcept {
+        const auto* properties = FindRule(stylesheet, selector);
+        if (!properties) { return nullptr; }
+
+        const auto it = properties->find(property);
+        return it != properties->end() ? &it->value : nullptr;
+    }
+
+    inline std::optional<std::string_view> GetProperty(const Stylesheet& stylesheet,
+                                                       std::string_view selector,
+                                                       std::string_view property) noexcept {
+        if (const auto* value = FindProperty(stylesheet, selector, property)) { return *value; }
+        return std::nullopt;
+    }
+
+    inline std::string_view GetProperty(const Stylesheet& stylesheet,
+                                        std::string_view selector,
+                                        std::string_view property,
+                                        std::string_view fallback) noexcept {
+        const auto* value = FindProperty(stylesheet, selector, property);
+        return value ? std::string_view(*value) : fallback;
+    }
+
+    // Combines `layers` in cascade order into a new stylesheet: later layers override the
+    // declarations of earlier ones, e.g. {&baseTheme, &productTheme, &userOverrides}.
+    inline Stylesheet MergeStylesheets(std::span<const Stylesheet* const> layers,
+                                       std::pmr::memory_resource* resource = nullptr) {
+        Stylesheet merged(resource ? resource : std::pmr::get_default_resource());
+
+        size_t count = 0;
+        for (const auto* layer : layers) {
+            count += layer->size();
+        }
+        merged.reserve(count);
+
+        for (const auto* layer : layers) {
+            merged.merge(*layer);
+        }
+        return merged;
+    }
+
+    inline Stylesheet MergeStylesheets(std::initializer_list<const Stylesheet*> layers,
+                                       std::pmr::memory_resource* resource = nullptr) {
+        return MergeStylesheets(std::span(layers.begin(), layers.size()), resource);
+    }
+
+    // Cascade of stylesheets that are looked up as if they had been merged, without copying
+    // them up front. A selector's declarations are flattened the first time it is looked up
+    // (and only copied at all if more than one layer has the selector). The layers are
+    // borrowed and must stay alive and unchanged while the view is used. Lookups are safe to
+    // call concurrently.
+    class LayeredStylesheet {
+    public:
+        LayeredStylesheet() = default;
+
+        explicit LayeredStylesheet(std::span<const Stylesheet* const> layers)
+            : layers(layers.begin(), layers.end()) {}
+
+        LayeredStylesheet(std::initializer_list<const Stylesheet*> layers)
+            : layers(layers.begin(), layers.end()) {}
+
+        LayeredStylesheet(const LayeredStylesheet&)            = delete;
+        LayeredStylesheet& operator=(const LayeredStylesheet&) = delete;
+
+        // Adds `layer` on top of the cascade. Not safe to call concurrently with lookups.
+        // Tables returned by `find()` before stay valid, but show the cascade as it was
+        // without `layer`; look the selector up again for the new result.
+        void push(const Stylesheet& layer) {
+            layers.push_back(&layer);
+            resolved.clear();
+        }
+
+        // Returns nullptr if no layer has `selector`.
+        [[nodiscard]] const PropertyTable* find(std::string_view selector) const {
+            {
+                std::shared_lock lock(mutex);
+                if (const auto it = resolved.find(selector); it != resolved.end()) {
+                    return it->second;
+                }
+            }
+
+            const PropertyTable* first = nullptr;
+            PropertyTable flattened;
+            bool merged = false;
+            for (const auto* layer : layers) {
+                const auto* properties = FindRule(*layer, selector);
+                if (!properties) { continue; }
+
+                if (!first) {
+                    first = properties;
+                } else {
+                    if (!merged) { flattened = *first; }
+                    flattened.merge(*properties);
+                    merged = true;
+                }
+            }
+            if (!first) { return nullptr; }
+
+            std::unique_lock lock(mutex);
+            if (const auto it = resolved.find(selector); it != resolved.end()) {
+                return it->second;
+            }
+
+            const PropertyTable* result =
+              merged ? &tables.emplace_back(std::move(flattened)) : first;
+            resolved.emplace(std::string(selector), result);
+            return result;
+        }
+
+        [[nodiscard]] std::optional<std::string_view> get(std::string_view selector,
+                                                          std::string_view property) const {
+            const auto* properties = find(selector);
+            if (!properties) { return std::nullopt; }
+
+            const auto it = properties->find(property);
+            if (it == properties->end()) { return std::nullopt; }
+            return it->value;
+        }
+
+        [[nodiscard]] std::string_view get(std::string_view selector,
+                                           std::string_view property,
+                                           std::string_view fallback) const {
+            return get(selector, property).value_or(fallback);
+        }
+
+        // Copies the whole cascade into a standalone stylesheet.
+        [[nodiscard]] Stylesheet flatten(std::pmr::memory_resource* resource = nullptr) const {
+            return MergeStylesheets(layers, resource);
+        }
+
+        [[nodiscard]] size_t layerCount() const noexcept {
+            return layers.size();
+        }
+
+    private:
+        std::vector<const Stylesheet*> layers;
+
+        mutable std::shared_mutex mutex;
+        // Points either into one of the layers or, for selectors several layers define,
+        // at a flattened copy in `tables` (a deque, so the addresses stay put). Tables are
+        // only freed with the view, since callers may still hold them after a `push()`.
+        mutable std::unordered_map<std::string, const PropertyTable*, StringHash, std::equal_to<>>
+          resolved;
+        mutable std::deque<PropertyTable> tables;
+    };
+
+    enum class SerializeFormat : uint8_t {
+        Pretty,    // one declaration per line, rules separated by a blank line
+        Minified,  // no optional whitespace
+    };
+
+    struct SerializeOptions {
+        SerializeFormat format = SerializeFormat::Pretty;
+        // Rules are written in source order unless this is set.
+        bool sortSelectors = false;
+    };
+
+    namespace Detail {
+        // Collects output in large blocks so the sink sees a few big writes instead of
+        // one per selector, property and value. Call `flush()` when done; the destructor
+        // doesn't, so a throwing sink can't end up throwing from it.
+        template<typename Sink>
+        class OutputBuffer {
+        public:
+            static constexpr size_t BlockSize = 64 * 1024;
+
+            explicit OutputBuffer(Sink& sink)
+                : sink(sink), block(std::make_unique_for_overwrite<char[]>(BlockSize)) {}
+
+            OutputBuffer(const OutputBuffer&)            = delete;
+            OutputBuffer& operator=(const OutputBuffer&) = delete;
+
+            void put(std::string_view str) {
+                if (str.size() > BlockSize - used) {
+                    flush();
+                    if (str.size() >= BlockSize) {
+                        sink(str);
+                        return;
+                    }
+                }
+                std::memcpy(block.get() + used, str.data(), str.size());
+                used += str.size();
+            }
+
+            void flush() {
+                if (used) { sink(std::string_view(block.get(), used)); }
+                used = 0;
+            }
+
+        private:
+            Sink& sink;
+            std::unique_ptr<char[]> block;
+            size_t used = 0;
+        };
+
+        // Writes into a fixed buffer, like snprintf(): output past `capacity` is dropped
+        // but still counted.
+        class BoundedOutput {
+        public:
+            BoundedOutput(char* buffer, size_t capacity) : buffer(buffer), capacity(capacity) {}
+
+            void put(std::string_view str) {
+                if (str.size() <= capacity - std::min(size, capacity)) {
+                    std::memcpy(buffer + size, str.data(), str.size());
+                } else if (size < capacity) {
+                    std::memcpy(buffer + size, str.data(), capacity - size);
+                }
+                size += str.size();
+            }
+
+            size_t size = 0;
+
+        private:
+            char* buffer;
+            size_t capacity;
+        };
+
+        // Values are stored without the quotes of string tokens. Put them back unless the
+        // value lexes as a single identifier, number or (6-digit) hex color again.
+        inline bool NeedsQuotes(std::string_view value) noexcept {
+            const auto isDigit  = [](char c) { return c >= '0' && c <= '9'; };
+            const auto isLetter = [](char c) {
+                return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '-';
+            };
+            const auto isHex = [&](char c) {
+                return isDigit(c) || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+            };
+
+            if (value.empty()) { return true; }
+            if (value[0] == '#') {
+                return value.size() != 7 || !std::ranges::all_of(value.substr(1), isHex);
+            }
+            if (isDigit(value[0])) { return !std::ranges::all_of(value, isDigit); }
+            return !std::ranges::all_of(value, [&](char c) { return isLetter(c) || isDigit(c); });
+        }
+
+        template<typename Output>
+        void WriteValue(Output& out, std::string_view value) {
+            if (NeedsQuotes(value)) {
+                out.put("\"");
+                out.put(value);
+                out.put("\"");
+            } else {
+                out.put(value);
+            }
+        }
+
+        template<typename Output, typename Rules>
+        void WriteRules(const Rules& rules, Output& out, SerializeFormat format) {
+            if (format == SerializeFormat::Minified) {
+                for (const auto& [selector, properties] : rules) {
+                    out.put(selector);
+                    out.put("{");
+                    for (const auto& declaration : properties) {
+                        out.put(declaration.property);
+                        out.put(":");
+                        WriteValue(out, declaration.value);
+                        if (declaration.important) { out.put("!important"); }
+                        out.put(";");
+                    }
+                    out.put("}");
+                }
+                return;
+            }
+
+            bool first = true;
+            for (const auto& [selector, properties] : rules) {
+                if (!first) { out.put("\n"); }
+                first = false;
+                out.put(selector);
+                out.put(" {\n");
+                for (const auto& declaration : properties) {
+                    out.put("    ");
+                    out.put(declaration.property);
+                    out.put(": ");
+                    WriteValue(out, declaration.value);
+                    if (declaration.important) { out.put(" !important"); }
+                    out.put(";\n");
+                }
+                out.put("}\n");
+            }
+        }
+
+        template<typename Output>
+        void WriteStylesheet(const Stylesheet& stylesheet,
+                             Output& out,
+                             const SerializeOptions& options) {
+            if (!options.sortSelectors) {
+                WriteRules(stylesheet, out, options.format);
+                return;
+            }
+
+            std::vector<const Stylesheet::value_type*> rules;
+            rules.reserve(stylesheet.size());
+            for (const auto& rule : stylesheet) { rules.push_back(&rule); }
+            std::ranges::sort(rules, {}, [](const auto* rule) {
+                return std::string_view(rule->first);
+            });
+
+            const auto sorted = rules | std::views::transform([](const auto* rule) -> const auto& {
+                                    return *rule;
+                                });
+            WriteRules(sorted, out, options.format);
+        }
+    }
+
+    // Writes `stylesheet` as CSS text, handing it to `sink(std::string_view)` in blocks
+    // of up to 64 KiB.
+    template<typename Sink>
+        requires std::invocable<Sink&, std::string_view>
+    void SerializeStylesheet(const Stylesheet& stylesheet,
+                             Sink&& sink,
+                             const SerializeOptions& options = {}) {
+        Detail::OutputBuffer<std::remove_reference_t<Sink>> out(sink);
+        Detail::WriteStylesheet(stylesheet, out, options);
+        out.flush();
+    }
+
+    // Writes up to `capacity` bytes into `buffer`, without a terminating '\0', and returns
+    // the size of the whole output. If that is larger than `capacity` the buffer holds a
+    // truncated prefix and the call can be repeated with a bigger one.
+    inline size_t SerializeStylesheet(const Stylesheet& stylesheet,
+                                      char* buffer,
+                                      size_t capacity,
+                                      const SerializeOptions& options = {}) {
+        Detail::BoundedOutput out(buffer, capacity);
+        Detail::WriteStylesheet(stylesheet, out, options);
+        return out.size;
+    }
+
+    inline std::string SerializeStylesheet(const Stylesheet& stylesheet,
+                                           const SerializeOptions& options = {}) {
+        std::string text;
+        SerializeStylesheet(stylesheet, [&](std::string_view block) { text += block; }, options);
+        return text;
+    }
+
+    // Returns false if writing to `file` failed.
+    inline bool SerializeStylesheet(const Stylesheet& stylesheet,
+                                    FILE* file,
+                                    const SerializeOptions& options = {}) {
+        bool ok = true;
+        SerializeStylesheet(
+          stylesheet,
+          [&](std::string_view block) {
+              ok = ok && std::fwrite(block.data(), 1, block.size(), file) == block.size();
+          },
+          options);
+        return ok;
+    }
+
+    inline void PrintStylesheet(const Stylesheet& stylesheet) {
+        SerializeStylesheet(stylesheet, stdout);
+    }
+
+    class FrozenStylesheet;
+
+    // A (selector, property) pair resolved against a FrozenStylesheet. The first read binds
+    // the handle to a slot index; later reads against the same sheet are a single array
+    // access. Reading through a different sheet (e.g. after a hot reload) rebinds it.
+    class PropertyHandle {
+    public:
+        PropertyHandle() = default;
+
+        PropertyHandle(std::string selector, std::string property)
+            : selector(std::move(selector)), property(std::move(property)) {}
+
+        PropertyHandle(const PropertyHandle& other)
+            : selector(other.selector), property(other.property),
+              binding(other.binding.load(std::memory_order_relaxed)) {}
+
+        PropertyHandle& operator=(const PropertyHandle& other) {
+            selector = other.selector;
+            property = other.property;
+            binding.store(other.binding.load(std::memory_order_relaxed),
+                          std::memory_order_relaxed);
+            return *this;
+        }
+
+        [[nodiscard]] const std::string& getSelector() const noexcept {
+            return selector;
+        }
+
+        [[nodiscard]] const std::string& getProperty() const noexcept {
+            return property;
+        }
+
+    private:
+        friend class FrozenStylesheet;
+
+        std::string selector;
+        std::string property;
+
+        // Upper 32 bits: generation of the sheet the slot belongs to (0 = unbound).
+        // Lower 32 bits: slot index, or `FrozenStylesheet::MissingSlot`.
+        mutable std::atomic<uint64_t> binding = 0;
+    };
+
+    // Immutable, flattened copy of a Stylesheet where every value lives in one contiguous
+    // array. Build a new one whenever the source stylesheet changes; existing handles
+    // notice the new generation and rebind on their next read.
+    class FrozenStylesheet {
+    public:
+        static constexpr uint32_t MissingSlot = UINT32_MAX;
+
+        FrozenStylesheet() : generation(NextGeneration()) {}
+
+        explicit FrozenStylesheet(const Stylesheet& stylesheet) : generation(NextGeneration()) {
+            size_t count = 0;
+            for (const auto& properties : stylesheet | std::views::values) {
+                count += properties.size();
+            }
+
+            values.reserve(count);
+            slots.reserve(stylesheet.size());
+            for (const auto& [selector, properties] : stylesheet) {
+                auto& ruleSlots = slots[std::string(selector)];
+                ruleSlots.reserve(properties.size());
+                for (const auto& declaration : properties) {
+                    ruleSlots.emplace(std::string(declaration.property),
+                                      static_cast<uint32_t>(values.size()));
+                    values.emplace_back(declaration.value);
+                }
+            }
+        }
+
+        [[nodiscard]] PropertyHandle resolve(std::string selector, std::string property) const {
+            PropertyHandle handle(std::move(selector), std::move(property));
+            bind(handle);
+            return handle;
+        }
+
+        [[nodiscard]] const std::string* find(const PropertyHandle& handle) const noexcept {
+            uint64_t binding = handle.binding.load(std::memory_order_relaxed);
+            if ((binding >> 32) != generation) { binding = bind(handle); }
+
+            const auto slot = static_cast<uint32_t>(binding);
+            return slot != MissingSlot ? &values[slot] : nullptr;
+        }
+
+        [[nodiscard]] std::optional<std::string_view> get(
+          const PropertyHandle& handle) const noexcept {
+            if (const auto* value = find(handle)) { return *value; }
+            return std::nullopt;
+        }
+
+        [[nodiscard]] std::string_view get(const PropertyHandle& handle,
+                                           std::string_view fallback) const noexcept {
+            const auto* value = find(handle);
+            return value ? std::string_view(*value) : fallback;
+        }
+
+        [[nodiscard]] uint32_t getGeneration() const noexcept {
+            return generation;
+        }
+
+    private:
+        using SlotTable = std::unordered_map<std::string, uint32_t, StringHash, std::equal_to<>>;
+
+        std::vector<std::string> values;
+        std::unordered_map<std::string, SlotTable, StringHash, std::equal_to<>> slots;
+        uint32_t generation;
+
+        static uint32_t NextGeneration() noexcept {
+            static std::atomic<uint32_t> counter = 0;
+            uint32_t next;
+            do {
+                next = counter.fetch_add(1, std::memory_order_relaxed) + 1;
+            } while (next == 0);  // 0 marks an unbound handle
+            return next;
+        }
+
+        uint64_t bind(const PropertyHandle& handle) const noexcept {
+            uint32_t slot = MissingSlot;
+            if (const auto rule = slots.find(handle.selector); rule != slots.end()) {
+                if (const auto it = rule->second.find(handle.property); it != rule->second.end()) {
+                    slot = it->second;
+                }
+            }
+
+            const uint64_t binding = (static_cast<uint64_t>(generation) << 32) | slot;
+            handle.binding.store(binding, std::memory_order_relaxed);
+            return binding;
+        }
+    };
+
+    // Converters used by StyleBinding. Each returns false if `value` can't be represented
+    // as the target type, leaving `out` untouched.
+    inline bool ConvertValue(std::string_view value, std::string& out) {
+        out.assign(value);
+        return true;
+    }
+
+    inline bool ConvertValue(std::string_view value, bool& out) noexcept {
+        if (value == "true") {
+            out = true;
+        } else if (value == "false") {
+            out = false;
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    template<typename T>
+        requires(std::is_arithmetic_v<T> && !std::is_same_v<T, bool>)
+    bool ConvertValue(std::string_view value, T& out) noexcept {
+        T result {};
+        const auto [end, ec] = std::from_chars(value.data(), value.data() + value.size(), result);
+        if (ec != std::errc() || end != value.data() + value.size()) { return false; }
+        out = result;
+        return true;
+    }
+
+    // Hex colors are stored with their leading '#', e.g. "#08090E" -> 0x0008090E. The '#'
+    // is optional here.
+    inline bool ConvertHexColor(std::string_view value, uint32_t& out) noexcept {
+        if (value.starts_with('#')) { value.remove_prefix(1); }
+        if (value.size() != 6) { return false; }
+
+        uint32_t result = 0;
+        const auto [end, ec] =
+          std::from_chars(value.data(), value.data() + value.size(), result, 16);
+        if (ec != std::errc() || end != value.data() + value.size()) { return false; }
+        out = result;
+        return true;
+    }
+
+    // Describes how the properties of a rule map onto the fields of a user struct:
+    //
+    //   CSS::StyleBinding<ButtonStyle> buttonBinding;
+    //   buttonBinding.field("border", &ButtonStyle::border)
+    //                .field("border-color", &ButtonStyle::borderColor, CSS::ConvertHexColor);
+    template<typename T>
+    class StyleBinding {
+    public:
+        template<typename Field>
+        StyleBinding& field(std::string property, Field T::* member) {
+            return field(std::move(property), member, [](std::string_view value, Field& out) {
+                return ConvertValue(value, out);
+            });
+        }
+
+        template<typename Field, typename Converter>
+        StyleBinding& field(std::string property, Field T::* member, Converter convert) {
+            setters.insert_or_assign(std::move(property),
+                                     [member, convert](T& target, std::string_view value) {
+                                         return static_cast<bool>(convert(value, target.*member));
+                                     });
+            return *this;
+        }
+
+    private:
+        friend class StyleBindings;
+
+        using Setter = std::function<bool(T&, std::string_view)>;
+        std::unordered_map<std::string, Setter, StringHash, std::equal_to<>> setters;
+    };
+
+    // Set of (selector -> struct instance) bindings the parser writes into directly. Bound
+    // declarations are converted as they are parsed; everything else is ignored.
+    class StyleBindings {
+        using Setter    = std::function<bool(std::string_view)>;
+        using SetterMap = std::unordered_map<std::string, Setter, StringHash, std::equal_to<>>;
+
+    public:
+        template<typename T>
+        StyleBindings& bind(std::string selector, T& target, const StyleBinding<T>& binding) {
+            auto& rule = rules[std::move(selector)];
+            rule.reserve(rule.size() + binding.setters.size());
+            for (const auto& [property, setter] : binding.setters) {
+                rule.insert_or_assign(property, [&target, setter](std::string_view value) {
+                    return setter(target, value);
+                });
+            }
+            return *this;
+        }
+
+        // Visitor that routes declarations to the bound setters. The rule lookup is done
+        // once per block; declarations of unbound selectors/properties are ignored. Like in a
+        // Stylesheet, a field set by an `!important` declaration keeps that value.
+        class Writer {
+        public:
+            explicit Writer(const StyleBindings& bindings) : bindings(bindings) {}
+
+            void onRuleStart(std::string_view selector) {
+                const auto it = bindings.rules.find(selector);
+                rule          = it != bindings.rules.end() ? &it->second : nullptr;
+            }
+
+            // Returns false only if the property is bound and its value failed to convert.
+            bool onDeclaration(std::string_view property, std::string_view value, bool important) {
+                if (!rule) { return true; }
+
+                const auto setter = rule->find(property);
+                if (setter == rule->end()) { return true; }
+
+                const Setter* field = &setter->second;
+                if (important) {
+                    setImportant.insert(field);
+                } else if (setImportant.contains(field)) {
+                    return true;
+                }
+                return (*field)(value);
+            }
+
+            void onRuleEnd() {
+                rule = nullptr;
+            }
+
+        private:
+            const StyleBindings& bindings;
+            const SetterMap* rule = nullptr;
+            std::unordered_set<const Setter*> setImportant;
+        };
+
+    private:
+        std::unordered_map<std::string, SetterMap, StringHash, std::equal_to<>> rules;
+    };
+
+    // Streaming interface for consumers that don't need a Stylesheet. The parser calls
+    // these in source order; the views point into the parser's token buffer and are only
+    // valid for the duration of the call. `onDeclaration` may return `bool`, in which case
+    // `false` rejects the value and stops the parse with an error. Visitors that care about
+    // `!important` can take it as a third `bool` argument; otherwise it is dropped.
+    template<typename V>
+    concept RuleVisitor = requires(V& visitor, std::string_view str) {
+        visitor.onRuleStart(str);
+        visitor.onRuleEnd();
+    } && (requires(V& visitor, std::string_view str) { visitor.onDeclaration(str, str); } ||
+          requires(V& visitor, std::string_view str, bool important) {
+              visitor.onDeclaration(str, str, important);
+          });
+
+    // Convenience base class for visitors that only care about some of the callbacks.
+    class Visitor {
+    public:
+        virtual ~Visitor() = default;
+
+        virtual void onRuleStart(std::string_view /*selector*/) {}
+        virtual void onDeclaration(std::string_view /*property*/, std::string_view /*value*/) {}
+        virtual void onRuleEnd() {}
+    };
+
+    namespace Detail {
+        enum class TokenType : uint8_t {
+            Identifier,
+            Number,
+            String,
+            Colon,
+            Semicolon,
+            BraceOpen,
+            BraceClose,
+            HexColor,
+            Bang,
+            Unknown,
+            EndOfFile,
+        };
+
+        // The lexer is a DFA: every input byte is mapped to a character class, and a single
+        // lookup in the (state x class) transition table yields the next state plus the
+        // actions to take. Both tables are generated at compile time.
+        enum LexerState : uint8_t {
+            Start,
+            InIdentifier,
+            InNumber,
+            InString,
+            InHexColor,
+            InSlash,
+            InComment,
+            InCommentStar,
+            StateCount,
+        };
+
+        enum CharClass : uint8_t {
+            Sentinel,  // '\0', which also pads the end of the lexer's buffer
+            Space,
+            Alpha,     // letters other than a-f, and '-'
+            HexAlpha,  // a-f and A-F
+            Digit,
+            Quote,
+            Colon,
+            Semicolon,
+            BraceOpen,
+            BraceClose,
+            Pound,
+            Slash,
+            Star,
+            Bang,
+            Other,
+            ClassCount,
+        };
+
+        // Transition layout: next state in the low bits, actions in the high bits.
+        inline constexpr uint8_t StateMask    = 0x0F;
+        inline constexpr uint8_t EmitPrevious = 0x10;  // finish the token in progress
+        inline constexpr uint8_t Begin        = 0x20;  // a new token starts at this byte
+        inline constexpr uint8_t EmitSingle   = 0x40;  // this byte is a token by itself
+        inline constexpr uint8_t AtSentinel   = 0x80;  // possibly the end of the input
+
+        using TransitionTable = std::array<std::array<uint8_t, ClassCount>, StateCount>;
+
+        constexpr std::array<uint8_t, 256> MakeByteClasses() {
+            std::array<uint8_t, 256> classes {};
+            for (int c = 0; c < 256; c++) {
+                if (c == '\0') {
+                    classes[c] = Sentinel;
+                } else if (c == ' ' || (c >= '\t' && c <= '\r')) {
+                    classes[c] = Space;
+                } else if ((c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F')) {
+                    classes[c] = HexAlpha;
+                } else if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '-') {
+                    classes[c] = Alpha;
+                } else if (c >= '0' && c <= '9') {
+                    classes[c] = Digit;
+                } else {
+                    switch (c) {
+                        case '"':
+                            classes[c] = Quote;
+                            break;
+                        case ':':
+                            classes[c] = Colon;
+                            break;
+                        case ';':
+                            classes[c] = Semicolon;
+                            break;
+                        case '{':
+                            classes[c] = BraceOpen;
+                            break;
+                        case '}':
+                            classes[c] = BraceClose;
+                            break;
+                        case '#':
+                            classes[c] = Pound;
+                            break;
+                        case '/':
+                            classes[c] = Slash;
+                            break;
+                        case '*':
+                            classes[c] = Star;
+                            break;
+                        case '!':
+                            classes[c] = Bang;
+                            break;
+                        default:
+                            classes[c] = Other;
+                            break;
+                    }
+                }
+            }
+            return classes;
+        }
+
+        // What happens to a byte of each class when no token is in progress. Disabled
+        // features make their opening character an unknown single-character token.
+        constexpr uint8_t StartTransition(uint8_t charClass, bool comments, bool strings) {
+            switch (charClass) {
+                case Space:
+                    return Start;
+                case Alpha:
+                case HexAlpha:
+                    return Begin | InIdentifier;
+                case Digit:
+                    return Begin | InNumber;
+                case Quote:
+                    return strings ? (Begin | InString) : (EmitSingle | Start);
+                case Pound:
+                    return Begin | InHexColor;
+                case Slash:
+                    return comments ? (Begin | InSlash) : (EmitSingle | Start);
+                default:
+                    return EmitSingle | Start;
+            }
+        }
+
+        constexpr TransitionTable MakeTransitions(bool comments, bool strings) {
+            TransitionTable table {};
+            for (uint8_t c = 0; c < ClassCount; c++) {
+                // Leaving a token: finish it, then treat the byte as if starting fresh.
+                const uint8_t start = StartTransition(c, comments, strings);
+                const uint8_t leave = EmitPrevious | start;
+                auto stay           = [](LexerState state) { return static_cast<uint8_t>(state); };
+
+                const bool word = c == Alpha || c == HexAlpha || c == Digit;
+                const bool hex  = c == HexAlpha || c == Digit;
+
+                table[Start][c]        = start;
+                table[InIdentifier][c] = word ? stay(InIdentifier) : leave;
+                table[InNumber][c]     = c == Digit ? stay(InNumber) : leave;
+                table[InString][c]     = c == Quote ? (EmitPrevious | Start) : stay(InString);
+                table[InHexColor][c]   = hex ? stay(InHexColor) : leave;
+                table[InSlash][c]      = c == Star ? stay(InComment) : leave;
+                table[InComment][c]    = c == Star ? InCommentStar : InComment;
+                table[InCommentStar][c] =
+                  c == Slash ? Start : (c == Star ? InCommentStar : InComment);
+            }
+
+            // The lexer decides whether a '\0' is the end of the buffer or part of the input.
+            for (auto& transitions : table) {
+                transitions[Sentinel] = AtSentinel;
+            }
+            return table;
+        }
+
+        constexpr std::array<TokenType, ClassCount> MakeSingleTokens() {
+            std::array<TokenType, ClassCount> tokens {};
+            tokens.fill(TokenType::Unknown);
+            tokens[Colon]      = TokenType::Colon;
+            tokens[Semicolon]  = TokenType::Semicolon;
+            tokens[BraceOpen]  = TokenType::BraceOpen;
+            tokens[BraceClose] = TokenType::BraceClose;
+            tokens[Bang]       = TokenType::Bang;
+            return tokens;
+        }
+
+        inline constexpr std::array<uint8_t, 256> ByteClasses           = MakeByteClasses();
+        inline constexpr std::array<TokenType, ClassCount> SingleTokens = MakeSingleTokens();
+
+        // One table per combination of lexer features, see the parser policies.
+        template<bool Comments, bool Strings>
+        inline constexpr TransitionTable Transitions = MakeTransitions(Comments, Strings);
+
+        // Lock-free single-producer/single-consumer ring. Slots are written and read in
+        // place: the producer fills `acquire()` and then `commit()`s it, the consumer reads
+        // `front()` and then `pop()`s it.
+        template<typename T, size_t Capacity>
+        class SpscRing {
+            static_assert(std::has_single_bit(Capacity), "Capacity must be a power of two");
+
+        public:
+            T* acquire() noexcept {
+                const size_t t = tail.load(std::memory_order_relaxed);
+                if (t - head.load(std::memory_order_acquire) == Capacity) { return nullptr; }
+                return &slots[t & (Capacity - 1)];
+            }
+
+            void commit() noexcept {
+                tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+            }
+
+            const T* front() noexcept {
+                const size_t h = head.load(std::memory_order_relaxed);
+                if (h == tail.load(std::memory_order_acquire)) { return nullptr; }
+                return &slots[h & (Capacity - 1)];
+            }
+
+            void pop() noexcept {
+                head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+            }
+
+            void clear() noexcept {
+                head.store(0, std::memory_order_relaxed);
+                tail.store(0, std::memory_order_relaxed);
+            }
+
+        private:
+            alignas(64) std::atomic<size_t> head = 0;  // next slot to read
+            alignas(64) std::atomic<size_t> tail = 0;  // next slot to write
+            std::array<T, Capacity> slots;
+        };
+
+        // Tokens handed from the lexer thread to the parser in pipelined mode, laid out
+        // like the parser's token stream so they can be appended with three bulk copies.
+        struct TokenBatch {
+            static constexpr size_t Capacity = 1024;
+
+            std::array<TokenType, Capacity> types;
+            std::array<uint32_t, Capacity> offsets;
+            std::array<uint32_t, Capacity> lengths;
+            size_t count = 0;
+        };
+
+        using TokenRing = SpscRing<TokenBatch, 16>;
+
+        // Passes allocations through to `upstream` and keeps track of how many bytes are
+        // currently allocated. Only used from one thread at a time.
+        class CountingResource : public std::pmr::memory_resource {
+        public:
+            explicit CountingResource(std::pmr::memory_resource* upstream) noexcept
+                : upstream(upstream) {}
+
+            [[nodiscard]] std::pmr::memory_resource* getUpstream() const noexcept {
+                return upstream;
+            }
+
+            [[nodiscard]] size_t getAllocated() const noexcept {
+                return allocated;
+            }
+
+        private:
+            std::pmr::memory_resource* upstream;
+            size_t allocated = 0;
+
+            void* do_allocate(size_t bytes, size_t alignment) override {
+                void* memory = upstream->allocate(bytes, alignment);
+                allocated += bytes;
+                return memory;
+            }
+
+            void do_deallocate(void* memory, size_t bytes, size_t alignment) override {
+                allocated -= bytes;
+                upstream->deallocate(memory, bytes, alignment);
+            }
+
+            [[nodiscard]] bool do_is_equal(const memory_resource& other) const noexcept override {
+                return this == &other;
+            }
+        };
+    }  // namespace Detail
+
+    // Bounds for untrusted input. Exceeding any of them stops the parse with an error.
+    struct ParseLimits {
+        size_t maxInputBytes           = SIZE_MAX;  // checked before the input is copied
+        size_t maxTokens               = SIZE_MAX;
+        size_t maxRules                = SIZE_MAX;
+        size_t maxDeclarationsPerBlock = SIZE_MAX;
+        size_t maxValueLength          = SIZE_MAX;
+
+        // Errors recorded before a recovering parse gives up with a final "Too many errors.".
+        size_t maxDiagnostics = SIZE_MAX;
+
+        // Bytes the parser holds at once: input and token buffers plus the stylesheet. This
+        // and `maxTokens` are checked after every lexed chunk (or pipelined batch) and every
+        // declaration, so they can be overshot by about one chunk.
+        size_t maxAllocatedBytes = SIZE_MAX;
+    };
+
+    struct ParseOptions {
+        // Rules whose selector fails this predicate are skipped without parsing their
+        // declarations. Leave empty to keep every rule.
+        std::function<bool(std::string_view)> selectorFilter;
+
+        // When non-empty, only these properties are stored (or passed to a visitor).
+        std::unordered_set<std::string, StringHash, std::equal_to<>> properties;
+
+        // Pre-scan the input to reserve the token buffer and tables at their final size
+        // instead of growing them (and rehashing) while parsing. Worth it for large inputs.
+        bool presize = false;
+
+        // Lex on a separate thread during `parse()`, handing tokens over in batches, so
+        // lexing and parsing overlap. Only worth the thread start-up for large inputs.
+        bool pipelined = false;
+
+        // Keep going after a syntax error: skip to the end of the broken declaration (or rule)
+        // and collect every error in `Parser::diagnostics`, returning a best-effort stylesheet.
+        // Limit violations still stop the parse.
+        bool recover = false;
+
+        // Lex in chunks as the parser reaches them instead of all at once in the
+        // constructor, so `parseSome()` spreads the lexing cost over its calls as well.
+        bool incremental = false;
+
+        // Source of every allocation the parser makes: its input and token buffers and the
+        // stylesheet it builds. Must outlive the parser and any stylesheet it returns.
+        // nullptr means `std::pmr::get_default_resource()`.
+        std::pmr::memory_resource* resource = nullptr;
+
+        // Recorded on every declaration of the stylesheet `parse()` builds, for merging it
+        // with sheets of other origins (see `CascadeRank`).
+        Origin origin = Origin::Author;
+
+        ParseLimits limits;
+    };
+
+    // Why `parseSome()` returned.
+    enum class ParseStatus {
+        Complete,   // reached the end of the input
+        Suspended,  // ran out of time or bytes, call `parseSome()` again to continue
+        Cancelled,  // a stop was requested through the budget's stop token
+        Failed,     // stopped at an error, see `lastError`
+    };
+
+    struct ParseProgress {
+        size_t bytesConsumed = 0;
+        size_t totalBytes    = 0;
+        size_t rulesParsed   = 0;
+    };
+
+    // Limits for a single `parseSome()` call. They are checked before every rule, so a call
+    // overruns its deadline by at most one rule. The byte budget always lets the first rule
+    // through, so every call makes progress unless it is out of time or cancelled.
+    struct ParseBudget {
+        static constexpr size_t ProgressInterval = 64;  // rules between progress reports
+
+        std::chrono::steady_clock::time_point deadline =
+          std::chrono::steady_clock::time_point::max();
+        size_t maxBytes = SIZE_MAX;  // input bytes to consume in this call
+        std::stop_token stopToken;
+
+        // Called every `ProgressInterval` rules and once more before `parseSome()` returns.
+        std::function<void(const ParseProgress&)> onProgress;
+    };
+
+    // Compile-time feature sets for BasicParser. Anything a policy turns off is compiled
+    // out of the lexer tables and the parser rather than checked at runtime.
+    //
+    //   AllowComments      `/* ... */` is skipped; otherwise '/' is an unexpected character.
+    //   AllowStrings       `"..."` values; otherwise '"' is an unexpected character.
+    //   ValidateHexColors  `#` colors must have exactly 6 digits.
+    //   TrackErrors        Errors carry a message and context; otherwise only `hadError` is
+    //                      set.
+    struct StrictPolicy {
+        static constexpr bool AllowComments     = true;
+        static constexpr bool AllowStrings      = true;
+        static constexpr bool ValidateHexColors = true;
+        static constexpr bool TrackErrors       = true;
+    };
+
+    // For minified stylesheets that were already validated at build time.
+    struct FastTrustedInputPolicy {
+        static constexpr bool AllowComments     = false;
+        static constexpr bool AllowStrings      = true;
+        static constexpr bool ValidateHexColors = false;
+        static constexpr bool TrackErrors       = false;
+    };
+
+    using DefaultPolicy = StrictPolicy;
+
+    template<typename Policy = DefaultPolicy>
+    class BasicParser {
+    public:
+        explicit BasicParser(std::string_view css, ParseOptions options = {})
+            : options(std::move(options)),
+              memory(std::make_unique<Detail::CountingResource>(UpstreamOf(this->options))),
+              lexer(memory->getUpstream()), tokens(resource()), ring(nullptr, {resource()}),
+              stylesheet(resource()), spareRules(resource()), spareDeclarations(resource()),
+              position(0) {
+            load(css);
+        }
+
+        // Moving keeps the buffers and the stylesheet, which may be allocated from `memory`.
+        // Assignment would have to reallocate them from the target's resource, so there is
+        // none; `reset()` the parser instead.
+        BasicParser(BasicParser&&) noexcept        = default;
+        BasicParser(const BasicParser&)            = delete;
+        BasicParser& operator=(const BasicParser&) = delete;
+
+        // Prepares the parser for a new input while keeping everything it has allocated so
+        // far: the input and token buffers keep their capacity, and the previous rules are
+        // kept aside (key strings, property tables and declarations included) for the next
+        // parse to reuse.
+        void reset(std::string_view css) {
+            const size_t spareBefore = spareRules.size();
+            stylesheet.extractAll(spareRules);
+            // Rules and declarations are taken from the back, so the next parse starts with
+            // the first one of each.
+            for (size_t i = spareRules.size(); i > spareBefore; i--) {
+                spareRules[i - 1].second.clear(spareDeclarations);
+            }
+            std::reverse(spareRules.begin() + static_cast<ptrdiff_t>(spareBefore),
+                         spareRules.end());
+
+            position    = 0;
+            rulesParsed = 0;
+            errorCount  = 0;
+            hadError    = false;
+            lastError   = {};
+            halted      = false;
+            diagnostics.clear();
+            load(css);
+        }
+
+        void parse() noexcept {
+            StylesheetBuilder builder(stylesheet, spareRules, spareDeclarations, options.origin);
+            parse(builder);
+        }
+
+        // Parses straight into the bound structs instead of building a Stylesheet.
+        void parse(const StyleBindings& target) noexcept {
+            StyleBindings::Writer writer(target);
+            parse(writer);
+        }
+
+        // Streams rules to `visitor` without building a Stylesheet.
+        template<RuleVisitor V>
+        void parse(V& visitor) noexcept {
+            if (lexPending) {
+                parsePipelined(visitor);
+                return;
+            }
+
+            while (!isAtEnd() && !halted) {
+                parseRule(visitor);
+            }
+        }
+
+        // Parses whole rules until the input ends, an error occurs or `budget` runs out, and
+        // returns which of these happened. The next call (or `parse()`) continues where this
+        // one stopped, so a large input can be spread over several frames. The lexer thread
+        // of pipelined mode can't outlive a call, so the input is lexed incrementally here.
+        ParseStatus parseSome(const ParseBudget& budget) noexcept {
+            StylesheetBuilder builder(stylesheet, spareRules, spareDeclarations, options.origin);
+            return parseSome(builder, budget);
+        }
+
+        template<RuleVisitor V>
+        ParseStatus parseSome(V& visitor, const ParseBudget& budget) noexcept {
+            if (lexPending) {
+                lexPending     = false;
+                lexIncremental = true;
+            }
+
+            auto status              = ParseStatus::Complete;
+            const size_t bytesBefore = consumedBytes();
+            const bool timed = budget.deadline != std::chrono::steady_clock::time_point::max();
+            for (size_t count = 0; !isAtEnd() && !halted; count++) {
+                if (budget.stopToken.stop_requested()) {
+                    status = ParseStatus::Cancelled;
+                    break;
+                }
+                if (timed && std::chrono::steady_clock::now() >= budget.deadline) {
+                    status = ParseStatus::Suspended;
+                    break;
+                }
+                if (count > 0 && consumedBytes() - bytesBefore >= budget.maxBytes) {
+                    status = ParseStatus::Suspended;
+                    break;
+                }
+                if (count % ParseBudget::ProgressInterval == 0 && budget.onProgress) {
+                    budget.onProgress(getProgress());
+                }
+
+                parseRule(visitor);
+            }
+
+            if (halted) { status = ParseStatus::Failed; }
+            if (budget.onProgress) { budget.onProgress(getProgress()); }
+            return status;
+        }
+
+        [[nodiscard]] ParseProgress getProgress() const noexcept {
+            return {consumedBytes(), lexer.input().size(), rulesParsed};
+        }
+
+        // The copy is allocated from `ParseOptions::resource`.
+        [[nodiscard]] Stylesheet getStylesheet() const {
+            return Stylesheet(stylesheet, memory->getUpstream());
+        }
+
+        bool hadError        = false;
+        ParseError lastError = {};  // the first error
+
+        // Every error, in source order. Without `ParseOptions::recover` that is at most one.
+        std::vector<ParseError> diagnostics;
+
+    private:
+        bool halted = false;  // stopped at an error
+
+        static std::pmr::memory_resource* UpstreamOf(const ParseOptions& options) noexcept {
+            return options.resource ? options.resource : std::pmr::get_default_resource();
+        }
+
+        // Allocations are only counted when there is a limit to enforce.
+        std::pmr::memory_resource* resource() noexcept {
+            if (options.limits.maxAllocatedBytes == SIZE_MAX) { return memory->getUpstream(); }
+            return memory.get();
+        }
+
+        void load(std::string_view css) {
+            // Token offsets are 32-bit, so inputs must stay below 4 GiB.
+            if (css.size() > options.limits.maxInputBytes || css.size() > UINT32_MAX) {
+                lexer.reset({});
+                lexPending     = false;
+                lexIncremental = false;
+                tokens.clear();
+                tokens.push({TokenType::EndOfFile, 0, 0});
+                makeFatalError(css.size() > options.limits.maxInputBytes
+                                 ? "Input exceeds the size limit."
+                                 : "Input is too large (maximum is 4 GiB).");
+                return;
+            }
+
+            lexer.reset(css);
+            tokenize();
+        }
+
+        void tokenize() {
+            if (options.presize) { presize(); }
+
+            tokens.clear();
+            droppedTokens  = 0;
+            lexPending     = options.pipelined;
+            lexIncremental = options.incremental && !lexPending;
+            if (lexPending || lexIncremental) { return; }
+
+            if (options.limits.maxTokens == SIZE_MAX &&
+                options.limits.maxAllocatedBytes == SIZE_MAX) {
+                lexer.tokenize(tokens);
+                return;
+            }
+
+            // Lex in chunks so a limit stops it early instead of after the whole input.
+            bool more = true;
+            while (more && checkTokenLimits()) {
+                more = lexer.tokenizeSome(tokens, LexChunkBytes);
+            }
+        }
+
+        bool checkTokenLimits() noexcept {
+            if (tokens.size() + droppedTokens > options.limits.maxTokens) {
+                makeFatalError("Too many tokens.");
+                return false;
+            }
+            return checkMemoryLimit();
+        }
+
+        // Whether reserving `bytes` more up front would stay within `maxAllocatedBytes`. A
+        // reservation that wouldn't is skipped; the parse then grows its buffers as usual and
+        // stops once it really uses that much.
+        [[nodiscard]] bool fitsMemoryLimit(size_t bytes) const noexcept {
+            const size_t limit     = options.limits.maxAllocatedBytes;
+            const size_t allocated = memory->getAllocated() + lexer.getAllocated();
+            return allocated <= limit && bytes <= limit - allocated;
+        }
+
+        bool checkMemoryLimit() noexcept {
+            if (memory->getAllocated() + lexer.getAllocated() > options.limits.maxAllocatedBytes) {
+                makeFatalError("Memory limit exceeded.");
+                return false;
+            }
+            return true;
+        }
+
+        template<typename V>
+        void parsePipelined(V& visitor) noexcept {
+            lexPending = false;
+            if (!ring) {
+                auto alloc = ring.get_deleter().alloc;
+                ring.reset(alloc.template new_object<Detail::TokenRing>());
+            }
+            ring->clear();
+
+            std::atomic<bool> stop = false;
+            std::thread producer;
+            try {
+                producer = std::thread([this, &stop] {
+                    BatchSink sink(*ring, stop);
+                    lexer.tokenize(sink);
+                    sink.flush();
+                });
+            } catch (...) {
+                // No thread available; lex up front instead.
+                lexer.tokenize(tokens);
+                parse(visitor);
+                return;
+            }
+
+            streaming = true;
+            while (!isAtEnd() && !halted) {
+                parseRule(visitor);
+            }
+
+            stop.store(true, std::memory_order_relaxed);
+            producer.join();
+            streaming = false;
+        }
+
+        // Pipelined mode: waits for the next batch from the lexer thread. Returns false once
+        // the EndOfFile token has been received.
+        bool pullTokens() noexcept {
+            if (lexIncremental) { return lexMore(); }
+            if (!streaming) { return false; }
+
+            const Detail::TokenBatch* batch;
+            while (!(batch = ring->front())) {
+                std::this_thread::yield();
+            }
+
+            tokens.append(*batch);
+            ring->pop();
+            if (!checkTokenLimits()) {
+                streaming = false;
+                return false;
+            }
+            if (tokens.types.back() == TokenType::EndOfFile) { streaming = false; }
+            return true;
+        }
+
+        // Incremental mode: lexes until at least one more token is available. Returns false
+        // once the EndOfFile token has been lexed.
+        bool lexMore() noexcept {
+            // Tokens before the previous one are never looked at again. Dropping them once
+            // they fill half the buffer keeps it at about a chunk's worth, so it doesn't
+            // reallocate (copying everything lexed so far) in the middle of a `parseSome()`.
+            if (position > 1 && position - 1 >= tokens.size() / 2) {
+                tokens.dropFront(position - 1);
+                droppedTokens += position - 1;
+                position = 1;
+            }
+
+            const size_t count = tokens.size();
+            while (lexIncremental && tokens.size() == count) {
+                lexIncremental = lexer.tokenizeSome(tokens, LexChunkBytes);
+                if (!checkTokenLimits()) { lexIncremental = false; }
+            }
+            return tokens.size() > count;
+        }
+
+        // Bytes of input before the next token to parse.
+        [[nodiscard]] size_t consumedBytes() const noexcept {
+            return position < tokens.size() ? tokens.offsets[position] : lexer.input().size();
+        }
+
+        void presize() {
+            const auto shape   = lexer.scanShape();
+            const auto& limits = options.limits;
+
+            // Every declaration is at most `property : value ;`, plus `! important` where it
+            // has a '!', and every rule adds its selector and braces, plus the trailing
+            // EndOfFile token. The counts come from the input, so they are capped at the
+            // limits that would stop the parse anyway.
+            const size_t tokenCount = std::min(
+              shape.declarations * 4 + shape.bangs * 2 + shape.rules * 3 + 1, limits.maxTokens);
+            const size_t ruleCount = std::min(shape.rules, limits.maxRules);
+
+            // Token: type, offset and length. Rule: the rule, its hash and up to four index
+            // slots.
+            constexpr size_t TokenBytes = sizeof(TokenType) + 2 * sizeof(uint32_t);
+            constexpr size_t RuleBytes =
+              sizeof(Stylesheet::value_type) + sizeof(size_t) + 4 * sizeof(uint32_t);
+            if (!fitsMemoryLimit(tokenCount * TokenBytes + ruleCount * RuleBytes)) { return; }
+
+            tokens.reserve(tokenCount);
+            if (stylesheet.size() + spareRules.size() < ruleCount) {
+                stylesheet.reserve(ruleCount);
+            }
+        }
+
+        // Stops the parse unless it is recovering; see `ParseOptions::recover`.
+        void makeError(std::string msg) {
+            if (halted) { return; }
+            if (errorCount == options.limits.maxDiagnostics) {
+                makeFatalError("Too many errors.");
+                return;
+            }
+
+            recordError(std::move(msg));
+            if (!options.recover) { halted = true; }
+        }
+
+        // Limits and input errors always stop the parse.
+        void makeFatalError(std::string msg) {
+            if (halted) { return; }
+
+            recordError(std::move(msg));
+            halted = true;
+        }
+
+        void recordError(std::string msg) {
+            if constexpr (Policy::TrackErrors) {
+                ParseError error(std::move(msg), consumedBytes(), lexer.getSource());
+                if (!hadError) { lastError = error; }
+                diagnostics.push_back(std::move(error));
+            }
+            errorCount++;
+            hadError = true;
+        }
+
+        using TokenType = Detail::TokenType;
+
+        struct Token {
+            TokenType type;
+            uint32_t offset;
+            uint32_t length;
+        };
+
+        // Tokens stored as parallel arrays: a type byte plus the offset and length of the
+        // token's text in the lexer input. Scans over token types (e.g. skipping a block)
+        // touch one byte per token, and no token owns a copy of its text.
+        struct TokenStream {
+            explicit TokenStream(std::pmr::memory_resource* resource)
+                : types(resource), offsets(resource), lengths(resource) {}
+
+            std::pmr::vector<TokenType> types;
+            std::pmr::vector<uint32_t> offsets;
+            std::pmr::vector<uint32_t> lengths;
+
+            [[nodiscard]] size_t size() const noexcept {
+                return types.size();
+            }
+
+            void push(const Token& token) {
+                types.push_back(token.type);
+                offsets.push_back(token.offset);
+                lengths.push_back(token.length);
+            }
+
+            void reserve(size_t count) {
+                types.reserve(count);
+                offsets.reserve(count);
+                lengths.reserve(count);
+            }
+
+            void clear() noexcept {
+                types.clear();
+                offsets.clear();
+                lengths.clear();
+            }
+
+            void dropFront(size_t count) noexcept {
+                const auto n = static_cast<ptrdiff_t>(count);
+                types.erase(types.begin(), types.begin() + n);
+                offsets.erase(offsets.begin(), offsets.begin() + n);
+                lengths.erase(lengths.begin(), lengths.begin() + n);
+            }
+
+            void append(const Detail::TokenBatch& batch) {
+                const auto count = static_cast<ptrdiff_t>(batch.count);
+                types.insert(types.end(), batch.types.begin(), batch.types.begin() + count);
+                offsets.insert(offsets.end(), batch.offsets.begin(), batch.offsets.begin() + count);
+                lengths.insert(lengths.end(), batch.lengths.begin(), batch.lengths.begin() + count);
+            }
+        };
+
+        // Table-driven lexer, see Detail::Transitions.
+        class Lexer {
+        public:
+            // The buffer holds the input followed by this many '\0' bytes, so the scanning
+            // loop needs no bounds check per byte (it stops on the first sentinel past the
+            // end) and wide loads near the end never read outside the allocation.
+            static constexpr size_t Padding = 64;
+
+            // `reset()` must be called before lexing. Errors may keep the source alive after
+            // the parser is gone, so it can't come from a resource the parser owns.
+            explicit Lexer(std::pmr::memory_resource* resource) : resource(resource) {}
+
+            void reset(std::string_view css) {
+                // Errors reported for the previous input may still refer to its source.
+                if (!source || source.use_count() > 1) {
+                    source = std::allocate_shared<Detail::Source>(
+                      std::pmr::polymorphic_allocator<> {resource}, resource);
+                }
+                source->assign(css, Padding);
+
+                resumeAt    = 0;
+                resumeState = Detail::Start;
+                resumeStart = 0;
+            }
 
-        void print() const {
-            fprintf(stderr, "ParseError:\n\n> %s\n\nError: %s\n", errLine.c_str(), errMsg.c_str());
-        }
+            [[nodiscard]] std::string_view input() const noexcept {
+                return source->text();
+            }
 
-        std::string errMsg;
-        std::string errLine;
-    };
+            [[nodiscard]] std::shared_ptr<const Detail::Source> getSource() const noexcept {
+                return source;
+            }
 
-    static void PrintStylesheet(Stylesheet& stylesheet) {
-        for (const auto& selector : stylesheet | std::views::keys) {
-            std::cout << selector << '\n';
-            for (const auto& [property, value] : stylesheet[selector]) {
-                std::cout << "  " << property << ':' << " " << value << '\n';
+            [[nodiscard]] size_t getAllocated() const noexcept {
+                return source ? source->capacity() : 0;
             }
-        }
-    }
 
-    class Parser {
-    public:
-        explicit Parser(const std::string& css) : position(0) {
-            lexer  = std::make_unique<Lexer>(css);
-            tokens = lexer->tokenize();
-        }
+            struct Shape {
+                size_t rules;
+                size_t declarations;
+                size_t bangs;  // '!', each adding the `! important` tokens to a declaration
+            };
 
-        void parse() noexcept {
-            while (!isAtEnd() && !hadError) {
-                parseRule();
+            // Upper bounds on the number of rules and declarations, counted in a single
+            // branch-free pass over the input that the compiler can vectorize.
+            [[nodiscard]] Shape scanShape() const noexcept {
+                size_t braces = 0, colons = 0, semicolons = 0, bangs = 0;
+                for (const char c : input()) {
+                    braces += c == '{';
+                    colons += c == ':';
+                    semicolons += c == ';';
+                    bangs += c == '!';
+                }
+                return {braces, std::max(colons, semicolons), bangs};
             }
-        }
 
-        [[nodiscard]] Stylesheet getStylesheet() const {
-            return stylesheet;
-        }
+            // Pushes every token, ending with EndOfFile, into `tokens`.
+            template<typename Sink>
+            void tokenize(Sink& tokens) const {
+                uint8_t state = Detail::Start;
+                size_t start  = 0;
+                scan<false>(tokens, 0, source->size(), state, start);
+                finish(tokens, state, start);
+            }
 
-        bool hadError        = false;
-        ParseError lastError = {};
+            // Lexes the next `bytes` bytes of input, carrying a token that is still in progress
+            // over to the next call. Returns false once the whole input, including the
+            // EndOfFile token, has been pushed.
+            template<typename Sink>
+            bool tokenizeSome(Sink& tokens, size_t bytes) {
+                const size_t length = source->size();
+                const size_t end    = resumeAt + std::min(bytes, length - resumeAt);
 
-    private:
-        void makeError(std::string msg) {
-            ParseError error;
-            error.errMsg  = std::move(msg);
-            error.errLine = lexer->input;
+                // Only the last chunk ends at the input's '\0' sentinel; the others are bounds
+                // checked, since the input is shared with `ParseError`s and mustn't be written.
+                if (end < length) {
+                    scan<true>(tokens, resumeAt, end, resumeState, resumeStart);
+                    resumeAt = end;
+                    return true;
+                }
+                scan<false>(tokens, resumeAt, end, resumeState, resumeStart);
+                resumeAt = end;
 
-            this->lastError = error;
-            this->hadError  = true;
-        }
+                finish(tokens, resumeState, resumeStart);
+                return false;
+            }
 
-        enum class TokenType {
-            Identifier,
-            Number,
-            String,
-            Colon,
-            Semicolon,
-            BraceOpen,
-            BraceClose,
-            HexColor,
-            Unknown,
-            EndOfFile,
-        };
+        private:
+            static constexpr auto& Transitions =
+              Detail::Transitions<Policy::AllowComments, Policy::AllowStrings>;
 
-        struct Token {
-            TokenType type;
-            std::string value;
-            Token(TokenType type, std::string value) : type(type), value(std::move(value)) {}
-        };
+            std::pmr::memory_resource* resource;
+            std::shared_ptr<Detail::Source> source;
 
-        class Lexer {
-        public:
-            explicit Lexer(std::string css) : input(std::move(css)), position(0) {}
+            // Where `tokenizeSome()` continues.
+            size_t resumeAt     = 0;
+            uint8_t resumeState = Detail::Start;
+            size_t resumeStart  = 0;
 
-            std::vector<Token> tokenize() {
-                std::vector<Token> tokens;
+            // Runs the DFA from `pos` until `end`. Unless `Bounded`, the byte at `end` must be
+            // the '\0' sentinel, which saves checking the position on every byte.
+            // `inOutState` and `inOutStart` describe the token in progress on entry and exit.
+            template<bool Bounded, typename Sink>
+            void scan(Sink& tokens,
+                      size_t pos,
+                      size_t end,
+                      uint8_t& inOutState,
+                      size_t& inOutStart) const {
+                const auto* bytes = reinterpret_cast<const unsigned char*>(source->text().data());
+                uint8_t state     = inOutState;  // locals, so they stay in registers
+                size_t start      = inOutStart;
+
+                for (;; pos++) {
+                    if constexpr (Bounded) {
+                        if (pos == end) { break; }
+                    }
+                    uint8_t charClass  = Detail::ByteClasses[bytes[pos]];
+                    uint8_t transition = Transitions[state][charClass];
 
-                while (position < input.size()) {
-                    const char currentChar = input[position];
+                    // Most bytes just move to the next state (inside a token, comment or
+                    // whitespace run), so the end-of-input check and the actions are all
+                    // behind a single branch.
+                    if (transition & ~Detail::StateMask) {
+                        if (transition & Detail::AtSentinel) {
+                            if (pos >= end) { break; }
 
-                    if (std::isspace(currentChar)) {
-                        size_t start = position;
-                        while (position < input.size() && std::isspace(input[position])) {
-                            position++;
+                            // A '\0' inside the input is just an unexpected character.
+                            charClass  = Detail::Other;
+                            transition = Transitions[state][charClass];
                         }
-                    } else if (std::isalpha(currentChar) || currentChar == '-') {
-                        tokens.push_back(lexIdentifier());
-                    } else if (std::isdigit(currentChar)) {
-                        tokens.push_back(lexNumber());
-                    } else if (currentChar == '"') {
-                        tokens.push_back(lexString());
-                    } else if (currentChar == ':') {
-                        tokens.emplace_back(TokenType::Colon, ":");
-                        position++;
-                    } else if (currentChar == ';') {
-                        tokens.emplace_back(TokenType::Semicolon, ";");
-                        position++;
-                    } else if (currentChar == '{') {
-                        tokens.emplace_back(TokenType::BraceOpen, "{");
-                        position++;
-                    } else if (currentChar == '}') {
-                        tokens.emplace_back(TokenType::BraceClose, "}");
-                        position++;
-                    } else if (currentChar == '#') {
-                        tokens.push_back(lexHexColor());
-                    } else if (currentChar == '/' && peek() == '*') {
-                        position += 2;  // Skip opening '/*'
-                        size_t start = position;
-
-                        while (position < input.size() &&
-                               !(input[position] == '*' && peek() == '/')) {
-                            position++;
+                        if (transition & Detail::EmitPrevious) { emit(tokens, state, start, pos); }
+                        if (transition & Detail::Begin) { start = pos; }
+                        if (transition & Detail::EmitSingle) {
+                            const auto type = Detail::SingleTokens[charClass];
+                            tokens.push({type, static_cast<uint32_t>(pos), 1});
                         }
-
-                        if (position < input.size()) {
-                            position += 2;  // Skip closing '*/'
+                        // Sinks that can refuse more tokens end the scan early.
+                        if constexpr (requires { tokens.stopped(); }) {
+                            if (tokens.stopped()) { break; }
                         }
-                    } else {
-                        tokens.emplace_back(TokenType::Unknown, std::string(1, currentChar));
-                        position++;
                     }
+                    state = transition & Detail::StateMask;
+                }
+
+                inOutState = state;
+                inOutStart = start;
+            }
+
+            template<typename Sink>
+            void finish(Sink& tokens, uint8_t state, size_t start) const {
+                const size_t size = source->size();
+                if (state == Detail::InString) {
+                    // Unterminated, don't accept the rest of the input as its value.
+                    const auto offset = static_cast<uint32_t>(start);
+                    tokens.push({TokenType::Unknown, offset, static_cast<uint32_t>(size - start)});
+                } else {
+                    emit(tokens, state, start, size);
                 }
+                tokens.push({TokenType::EndOfFile, static_cast<uint32_t>(size), 0});
+            }
+
+            // Finishes the token that started at `start` in `state` and ends before `end`.
+            template<typename Sink>
+            static void emit(Sink& tokens, uint8_t state, size_t start, size_t end) {
+                const auto offset = static_cast<uint32_t>(start);
+                const auto length = static_cast<uint32_t>(end - start);
 
-                tokens.emplace_back(TokenType::EndOfFile, "");
-                return tokens;
+                switch (state) {
+                    case Detail::InIdentifier:
+                        tokens.push({TokenType::Identifier, offset, length});
+                        break;
+                    case Detail::InNumber:
+                        tokens.push({TokenType::Number, offset, length});
+                        break;
+                    case Detail::InString:  // without the quotes
+                        tokens.push({TokenType::String, offset + 1, length - 1});
+                        break;
+                    case Detail::InHexColor:  // pound sign included
+                        if (!Policy::ValidateHexColors || length - 1 == 6) {
+                            tokens.push({TokenType::HexColor, offset, length});
+                        } else {
+                            tokens.push({TokenType::Unknown, offset, length});
+                        }
+                        break;
+                    case Detail::InSlash:  // lone '/'
+                        tokens.push({TokenType::Unknown, offset, length});
+                        break;
+                    default:
+                        break;
+                }
             }
+        };
 
-            std::string input;
+        // Feeds the lexer's output into the ring from another thread.
+        class BatchSink {
+        public:
+            BatchSink(Detail::TokenRing& ring, const std::atomic<bool>& stop)
+                : ring(ring), stop(stop) {}
 
-        private:
-            std::size_t position;
+            void push(const Token& token) noexcept {
+                if (!batch && !(batch = acquire())) { return; }
 
-            [[nodiscard]] char peek(int offset = 1) const {
-                return (position + offset < input.size()) ? input[position + offset] : '\0';
+                batch->types[batch->count]   = token.type;
+                batch->offsets[batch->count] = token.offset;
+                batch->lengths[batch->count] = token.length;
+                if (++batch->count == Detail::TokenBatch::Capacity) { flush(); }
             }
 
-            Token lexIdentifier() {
-                const size_t start = position;
-                while (position < input.size() &&
-                       (std::isalnum(input[position]) || input[position] == '-')) {
-                    position++;
-                }
-                return {TokenType::Identifier, input.substr(start, position - start)};
+            void flush() noexcept {
+                if (!batch) { return; }
+                ring.commit();
+                batch  = nullptr;
+                gaveUp = stop.load(std::memory_order_relaxed);
             }
 
-            Token lexNumber() {
-                const size_t start = position;
-                while (position < input.size() && std::isdigit(input[position])) {
-                    position++;
-                }
-                return {TokenType::Number, input.substr(start, position - start)};
+            // True once the parser has stopped consuming, checked once per batch. The lexer
+            // stops scanning then instead of running on to the end of the input.
+            [[nodiscard]] bool stopped() const noexcept {
+                return gaveUp;
             }
 
-            Token lexHexColor() {
-                position++;  // Skip pound sign
-                const size_t start = position;
+        private:
+            Detail::TokenRing& ring;
+            const std::atomic<bool>& stop;
+            Detail::TokenBatch* batch = nullptr;
+            bool gaveUp               = false;
 
-                while (position < input.size() && input[position] != ';') {
-                    position++;
+            // Waits for a free slot; gives up if the parser has stopped consuming.
+            Detail::TokenBatch* acquire() noexcept {
+                while (!stop.load(std::memory_order_relaxed)) {
+                    if (auto* slot = ring.acquire()) {
+                        slot->count = 0;
+                        return slot;
+                    }
+                    std::this_thread::yield();
                 }
+                gaveUp = true;
+                return nullptr;
+            }
+        };
+
+    private:
+        ParseOptions options;
+        std::unique_ptr<Detail::CountingResource> memory;  // on the heap so it stays put on moves
 
-                if ((position - start) != 6) { return {TokenType::Unknown, "<InvalidColor>"}; }
+        struct RingDeleter {
+            std::pmr::polymorphic_allocator<> alloc;
 
-                return {TokenType::HexColor, input.substr(start, position - start)};
+            void operator()(Detail::TokenRing* ring) {
+                alloc.delete_object(ring);
             }
+        };
 
-            Token lexString() {
-                position++;  // Skip opening quote
-                const size_t start = position;
+        Lexer lexer;
+        TokenStream tokens;
+        std::unique_ptr<Detail::TokenRing, RingDeleter> ring;
+        bool lexPending      = false;  // pipelined mode, lexing starts with `parse()`
+        bool streaming       = false;  // tokens are still arriving from the lexer thread
+        bool lexIncremental  = false;  // incremental mode, input left to lex
+        size_t droppedTokens = 0;      // incremental mode, consumed tokens already discarded
+        size_t rulesParsed   = 0;
+        size_t errorCount    = 0;
 
-                while (position < input.size() && input[position] != '"') {
-                    position++;
-                }
+        static constexpr size_t LexChunkBytes = 64 * 1024;
+        Stylesheet stylesheet;
+        std::pmr::vector<Stylesheet::value_type> spareRules;
+        std::pmr::vector<Declaration> spareDeclarations;
+
+        // Default visitor used by `parse()`. Rules are only created once they receive a
+        // declaration, so empty blocks don't show up in the stylesheet.
+        class StylesheetBuilder {
+        public:
+            StylesheetBuilder(Stylesheet& stylesheet,
+                              std::pmr::vector<Stylesheet::value_type>& spareRules,
+                              std::pmr::vector<Declaration>& spareDeclarations,
+                              Origin origin)
+                : stylesheet(stylesheet), spareRules(spareRules),
+                  spareDeclarations(spareDeclarations), origin(origin) {}
+
+            void onRuleStart(std::string_view ruleSelector) {
+                selector     = ruleSelector;
+                rule         = nullptr;
+                expectedSize = 0;
+            }
 
-                if (position < input.size()) {
-                    position++;  // Skip closing quote
+            void expectDeclarations(size_t count) {
+                expectedSize = count;
+            }
+
+            // Within a block an `!important` declaration isn't overridden by a later normal one.
+            void onDeclaration(std::string_view property, std::string_view value, bool important) {
+                if (!rule) {
+                    auto it = stylesheet.find(selector);
+                    if (it == stylesheet.end()) {
+                        if (spareRules.empty()) {
+                            it = stylesheet.try_emplace(selector).first;
+                        } else {
+                            spareRules.back().first.assign(selector);
+                            it = stylesheet.insert(std::move(spareRules.back())).first;
+                            spareRules.pop_back();
+                        }
+                    }
+                    rule = &it->second;
+                    if (expectedSize > 0) { rule->reserve(rule->size() + expectedSize); }
                 }
 
-                return {TokenType::String, input.substr(start, position - start - 1)};
+                rule->cascade(property, value, origin, important, spareDeclarations);
             }
+
+            void onRuleEnd() {
+                rule = nullptr;
+            }
+
+        private:
+            Stylesheet& stylesheet;
+            std::pmr::vector<Stylesheet::value_type>& spareRules;
+            std::pmr::vector<Declaration>& spareDeclarations;
+            Origin origin;
+            std::string_view selector;
+            PropertyTable* rule = nullptr;
+            size_t expectedSize = 0;
         };
 
     private:
-        std::unique_ptr<Lexer> lexer;
-        std::vector<Token> tokens;
-        Stylesheet stylesheet;
+        friend class LazyStylesheet;
 
-    private:
         std::size_t position;
 
-        [[nodiscard]] bool isAtEnd() const noexcept {
-            return (position >= tokens.size()) or
-                   (tokens.at(position).type == TokenType::EndOfFile);
+        [[nodiscard]] bool isAtEnd() noexcept {
+            if (position >= tokens.size() && !pullTokens()) { return true; }
+            return tokens.types[position] == TokenType::EndOfFile;
         }
 
-        Token advance() noexcept {
+        void advance() noexcept {
             if (!isAtEnd()) position++;
-            return tokens.at(position - 1);
         }
 
-        [[nodiscard]] Token peek() const noexcept {
-            return tokens.at(position);
+        [[nodiscard]] TokenType peek() const noexcept {
+            return tokens.types[position];
+        }
+
+        [[nodiscard]] std::string_view text(size_t index) const noexcept {
+            return {lexer.input().data() + tokens.offsets[index], tokens.lengths[index]};
+        }
+
+        // Text of the token that was just matched.
+        [[nodiscard]] std::string_view previous() const noexcept {
+            return position > 0 ? text(position - 1) : std::string_view {};
         }
 
         bool match(TokenType type) noexcept {
-            if (isAtEnd() or peek().type != type) return false;
+            if (isAtEnd() or peek() != type) return false;
             advance();
             return true;
         }
 
-        void parseRule() noexcept {
+        template<typename V>
+        void parseRule(V& visitor) noexcept {
             const auto selector = parseSelector();
-            if (!match(TokenType::BraceOpen)) { makeError("Expected '{' after selector."); }
+            if (!match(TokenType::BraceOpen)) {
+                makeError("Expected '{' after selector.");
+                skipRule();
+                return;
+            }
+            if (++rulesParsed > options.limits.maxRules) {
+                makeFatalError("Too many rules.");
+                return;
+            }
 
-            parseDeclarationBlock(selector);
+            if (options.selectorFilter && !options.selectorFilter(selector)) {
+                skipDeclarationBlock();
+                if (!match(TokenType::BraceClose)) {
+                    makeError("Expected '}' after declaration block.");
+                }
+                return;
+            }
+
+            visitor.onRuleStart(selector);
+            if constexpr (requires { visitor.expectDeclarations(size_t {}); }) {
+                if (options.presize) {
+                    // Declaration, hash and up to three index slots each.
+                    constexpr size_t DeclarationBytes = sizeof(Declaration) + 4 * sizeof(uint32_t);
+
+                    const size_t count =
+                      std::min(countDeclarations(), options.limits.maxDeclarationsPerBlock);
+                    if (fitsMemoryLimit(count * DeclarationBytes)) {
+                        visitor.expectDeclarations(count);
+                    }
+                }
+            }
+            parseDeclarations(visitor, true);
 
             if (!match(TokenType::BraceClose)) {
                 makeError("Expected '}' after declaration block.");
             }
+            visitor.onRuleEnd();
         }
 
-        std::string parseSelector() noexcept {
-            std::string selector;
-            if (match(TokenType::Identifier)) { selector = tokens.at(position - 1).value; }
+        std::string_view parseSelector() noexcept {
+            std::string_view selector;
+            if (match(TokenType::Identifier)) { selector = previous(); }
             return selector;
         }
 
-        void parseDeclarationBlock(const std::string& selector) noexcept {
-            while (peek().type != TokenType::BraceClose and !isAtEnd()) {
-                parseDeclaration(selector);
+        // Number of declarations in the block starting at the current token.
+        [[nodiscard]] size_t countDeclarations() const noexcept {
+            const auto begin = tokens.types.begin() + static_cast<ptrdiff_t>(position);
+            const auto end   = std::find(begin, tokens.types.end(), TokenType::BraceClose);
+            return static_cast<size_t>(std::count(begin, end, TokenType::Semicolon));
+        }
+
+        // Jumps to the block's closing brace (or the EndOfFile token).
+        void skipDeclarationBlock() noexcept {
+            while (true) {
+                const auto begin = tokens.types.begin() + static_cast<ptrdiff_t>(position);
+                const auto it    = std::find(begin, tokens.types.end(), TokenType::BraceClose);
+                position += static_cast<size_t>(it - begin);
+                if (it != tokens.types.end()) { return; }
+
+                if (!pullTokens()) {
+                    position = tokens.size() - 1;
+                    return;
+                }
+            }
+        }
+
+        // Parses declarations up to the '}' that closes the current block or, without
+        // `stopAtBrace`, up to the end of the input (a bare declaration list, i.e. the inside
+        // of a single `{...}` block). A declaration that fails consumes nothing, so the loop
+        // either stops at the error or, when recovering, skips the broken declaration.
+        // Carrying on from the same token would spin forever (e.g. `a { { }`).
+        template<typename V>
+        void parseDeclarations(V& visitor, bool stopAtBrace) noexcept {
+            for (size_t count = 0; !isAtEnd() && !halted; count++) {
+                if (stopAtBrace && peek() == TokenType::BraceClose) { return; }
+                if (count == options.limits.maxDeclarationsPerBlock) {
+                    makeFatalError("Too many declarations in block.");
+                    return;
+                }
+                if (!parseDeclaration(visitor)) { skipDeclaration(); }
             }
         }
 
-        void parseDeclaration(const std::string& selector) noexcept {
-            if (!match(TokenType::Identifier)) { makeError("Expected property name."); }
-            const std::string property = tokens.at(position - 1).value;
+        // Recovery: skips the rest of a broken declaration, up to and including its ';' but
+        // not past the '}' that closes the block.
+        void skipDeclaration() noexcept {
+            if (halted) { return; }
 
-            if (!match(TokenType::Colon)) { makeError("Expected ':' after property name."); }
-            const std::string value = parseValue();
+            while (!isAtEnd() && peek() != TokenType::BraceClose) {
+                const bool end = peek() == TokenType::Semicolon;
+                advance();
+                if (end) { return; }
+            }
+        }
 
-            if (!match(TokenType::Semicolon)) { makeError("Expected ';' after property value."); }
+        // Recovery: skips the rest of a broken rule, up to and including its '}'.
+        void skipRule() noexcept {
+            if (halted) { return; }
 
-            // Store result in stylesheet
-            stylesheet[selector][property] = value;
+            while (!isAtEnd()) {
+                const bool end = peek() == TokenType::BraceClose;
+                advance();
+                if (end) { return; }
+            }
         }
 
-        std::string parseValue() noexcept {
-            std::string value;
+        // Returns false on a syntax error, leaving the rest of the declaration unconsumed.
+        template<typename V>
+        bool parseDeclaration(V& visitor) noexcept {
+            if (!match(TokenType::Identifier)) {
+                makeError("Expected property name.");
+                return false;
+            }
+            const std::string_view property = previous();
+
+            if (!match(TokenType::Colon)) {
+                makeError("Expected ':' after property name.");
+                return false;
+            }
+
+            const auto value = parseValue();
+            if (!value) { return false; }
+
+            bool important = false;
+            if (match(TokenType::Bang)) {
+                if (!match(TokenType::Identifier) || previous() != "important") {
+                    makeError("Expected 'important' after '!'.");
+                    return false;
+                }
+                important = true;
+            }
+
+            if (!match(TokenType::Semicolon)) {
+                makeError("Expected ';' after property value.");
+                return false;
+            }
+            if (!options.properties.empty() && !options.properties.contains(property)) {
+                return true;
+            }
+
+            const auto deliver = [&] {
+                if constexpr (requires { visitor.onDeclaration(property, *value, important); }) {
+                    return visitor.onDeclaration(property, *value, important);
+                } else {
+                    return visitor.onDeclaration(property, *value);
+                }
+            };
 
-            if (match(TokenType::Number) or match(TokenType::String) or
-                match(TokenType::Identifier) or match(TokenType::HexColor)) {
-                value = tokens.at(position - 1).value;  // Skip the value for now
+            // A rejected value is reported, but the declaration itself was well-formed.
+            if constexpr (std::is_same_v<decltype(deliver()), bool>) {
+                if (!deliver()) {
+                    if constexpr (Policy::TrackErrors) {
+                        makeError("Invalid value for property '" + std::string(property) + "'.");
+                    } else {
+                        makeError({});
+                    }
+                }
             } else {
+                deliver();
+            }
+            checkMemoryLimit();
+            return true;
+        }
+
+        std::optional<std::string_view> parseValue() noexcept {
+            if (!(match(TokenType::Number) or match(TokenType::String) or
+                  match(TokenType::Identifier) or match(TokenType::HexColor))) {
                 makeError("Expected a value after '<property>:'.");
+                return std::nullopt;
             }
 
+            const std::string_view value = previous();
+            if (value.size() > options.limits.maxValueLength) {
+                makeFatalError("Value exceeds the length limit.");
+                return std::nullopt;
+            }
             return value;
         }
     };
-}  // namespace CSS
\ No newline at end of file
+
+    using Parser = BasicParser<>;
+
+    // Stylesheet that only indexes selectors up front. `parse()` records where each rule's
+    // `{...}` block starts and ends; the declarations of a selector are lexed and parsed the
+    // first time it is looked up. Lookups are safe to call concurrently.
+    class LazyStylesheet {
+    public:
+        // The input copy, the rule index and the parsed declaration tables are allocated from
+        // `resource`.
+        explicit LazyStylesheet(std::string_view css,
+                                std::pmr::memory_resource* resource = nullptr)
+            : resource(resource ? resource : std::pmr::get_default_resource()),
+              source(MakeSource(css, this->resource)), input(source->text()), rules(this->resource),
+              index(this->resource) {}
+
+        LazyStylesheet(const LazyStylesheet&)            = delete;
+        LazyStylesheet& operator=(const LazyStylesheet&) = delete;
+
+        // Indexes the input once; later calls are no-ops, so tables returned by `find()` stay
+        // valid.
+        void parse() noexcept {
+            if (indexed) { return; }
+            indexed = true;
+
+            size_t pos = 0;
+            while (!hadError) {
+                skipTrivia(pos);
+                if (pos >= input.size()) { break; }
+
+                const size_t selectorStart = pos;
+                if (pos < input.size() && isIdentifierStart(input[pos])) {
+                    while (pos < input.size() && isIdentifierChar(input[pos])) {
+                        pos++;
+                    }
+                }
+                const std::string_view selector(input.data() + selectorStart, pos - selectorStart);
+
+                skipTrivia(pos);
+                if (pos >= input.size() || input[pos] != '{') {
+                    makeError("Expected '{' after selector.", pos);
+                    break;
+                }
+
+                const size_t blockStart = ++pos;
+                if (!skipBlock(pos)) {
+                    makeError("Expected '}' after declaration block.", blockStart - 1);
+                    break;
+                }
+
+                auto it = index.find(selector);
+                if (it == index.end()) {
+                    it = index.emplace(selector, &rules.emplace_back(resource)).first;
+                }
+                it->second->blocks.emplace_back(blockStart, pos - 1);
+            }
+        }
+
+        // Returns nullptr for unknown selectors. The block is parsed on first access; if it
+        // contains an error the declarations before it are kept and `findError()` reports it.
+        [[nodiscard]] const PropertyTable* find(std::string_view selector) const noexcept {
+            Rule* rule = lookup(selector);
+            return rule ? &rule->properties : nullptr;
+        }
+
+        [[nodiscard]] const ParseError* findError(std::string_view selector) const noexcept {
+            Rule* rule = lookup(selector);
+            return (rule && rule->hadError) ? &rule->error : nullptr;
+        }
+
+        [[nodiscard]] std::optional<std::string_view> get(
+          std::string_view selector, std::string_view property) const noexcept {
+            const auto* properties = find(selector);
+            if (!properties) { return std::nullopt; }
+
+            const auto it = properties->find(property);
+            if (it == properties->end()) { return std::nullopt; }
+            return it->value;
+        }
+
+        [[nodiscard]] std::string_view get(std::string_view selector,
+                                           std::string_view property,
+                                           std::string_view fallback) const noexcept {
+            return get(selector, property).value_or(fallback);
+        }
+
+        [[nodiscard]] size_t size() const noexcept {
+            return index.size();
+        }
+
+        bool hadError        = false;
+        ParseError lastError = {};
+
+    private:
+        struct Rule {
+            explicit Rule(std::pmr::memory_resource* resource)
+                : blocks(resource), properties(resource) {}
+
+            std::pmr::vector<std::pair<size_t, size_t>> blocks;
+            std::once_flag parsed;
+            PropertyTable properties;
+            ParseError error;
+            bool hadError = false;
+        };
+
+        class TableBuilder {
+        public:
+            explicit TableBuilder(PropertyTable& properties) : properties(properties) {}
+
+            void onRuleStart(std::string_view) {}
+            void onRuleEnd() {}
+
+            void onDeclaration(std::string_view property, std::string_view value, bool important) {
+                properties.cascade(property, value, Origin::Author, important);
+            }
+
+        private:
+            PropertyTable& properties;
+        };
+
+        std::pmr::memory_resource* resource;
+        std::shared_ptr<const Detail::Source> source;
+        std::string_view input;
+        // Rules live in a deque so their addresses (and once_flags) stay put while indexing.
+        mutable std::pmr::deque<Rule> rules;
+        std::pmr::unordered_map<std::pmr::string, Rule*, StringHash, std::equal_to<>> index;
+        bool indexed = false;
+
+        static std::shared_ptr<const Detail::Source> MakeSource(
+          std::string_view css, std::pmr::memory_resource* resource) {
+            auto source = std::allocate_shared<Detail::Source>(
+              std::pmr::polymorphic_allocator<> {resource}, resource);
+            source->assign(css, 0);
+            return source;
+        }
+
+        void makeError(std::string msg, size_t offset) {
+            lastError = ParseError(std::move(msg), offset, source);
+            hadError  = true;
+        }
+
+        Rule* lookup(std::string_view selector) const noexcept {
+            const auto it = index.find(selector);
+            if (it == index.end()) { return nullptr; }
+
+            Rule* rule = it->second;
+            std::call_once(rule->parsed, [this, rule] { parseRule(*rule); });
+            return rule;
+        }
+
+        void parseRule(Rule& rule) const {
+            TableBuilder builder(rule.properties);
+            for (const auto& [start, end] : rule.blocks) {
+                ParseOptions options;
+                options.resource = resource;
+
+                Parser parser(input.substr(start, end - start), std::move(options));
+                parser.parseDeclarations(builder, false);
+                if (parser.hadError) {
+                    // Point the error at the stylesheet rather than the block.
+                    const ParseError& error = parser.lastError;
+                    rule.error    = ParseError(error.errMsg, start + error.errOffset, source);
+                    rule.hadError = true;
+                    break;
+                }
+            }
+        }
+
+        // Same rules as the lexer: an identifier starts with a letter or '-' and goes on
+        // with letters, digits and '-'.
+        static bool isIdentifierStart(char c) noexcept {
+            const uint8_t charClass = Detail::ByteClasses[static_cast<unsigned char>(c)];
+            return charClass == Detail::Alpha || charClass == Detail::HexAlpha;
+        }
+
+        static bool isIdentifierChar(char c) noexcept {
+            return isIdentifierStart(c) ||
+                   Detail::ByteClasses[static_cast<unsigned char>(c)] == Detail::Digit;
+        }
+
+        // Skips whitespace and comments.
+        void skipTrivia(size_t& pos) const noexcept {
+            while (pos < input.size()) {
+                if (Detail::ByteClasses[static_cast<unsigned char>(input[pos])] == Detail::Space) {
+                    pos++;
+                } else if (input.compare(pos, 2, "/*") == 0) {
+                    const size_t end = input.find("*/", pos + 2);
+                    pos              = end == std::string::npos ? input.size() : end + 2;
+                } else {
+                    break;
+                }
+            }
+        }
+
+        // Advances `pos` past the closing '}' of the block it is in, skipping strings and
+        // comments. Returns false if the input ends first.
+        bool skipBlock(size_t& pos) const noexcept {
+            while (true) {
+                pos = input.find_first_of("}\"/", pos);
+                if (pos == std::string::npos) { return false; }
+
+                if (input[pos] == '}') {
+                    pos++;
+                    return true;
+                }
+
+                if (input[pos] == '"') {
+                    pos = input.find('"', pos + 1);
+                    if (pos == std::string::npos) { return false; }
+                    pos++;
+                } else if (input.compare(pos, 2, "/*") == 0) {
+                    pos = input.find("*/", pos + 2);
+                    if (pos == std::string::npos) { return false; }
+                    pos += 2;
+                } else {
+                    pos++;
+                }
+            }
+        }
+    };
+
+    // Holds the current version of a stylesheet (or a FrozenStylesheet, LazyStylesheet, ...)
+    // that a background thread replaces while other threads keep reading it. `acquire()` is
+    // wait-free: a single atomic add that yields an immutable snapshot. `publish()` swaps in
+    // a new version atomically; the old one is destroyed when its last snapshot is released.
+    // Types that can't be moved, like LazyStylesheet, are published as a `std::unique_ptr`.
+    // Snapshots must not outlive the holder.
+    template<typename T = Stylesheet>
+    class SnapshotHolder {
+        struct Version;
+
+    public:
+        // Keeps one version alive. Move-only; release it (or let it go out of scope) soon,
+        // a holder can only keep `MaxVersions - 1` old versions around at once.
+        class Snapshot {
+        public:
+            Snapshot() noexcept = default;
+
+            Snapshot(Snapshot&& other) noexcept : version(std::exchange(other.version, nullptr)) {}
+
+            Snapshot& operator=(Snapshot&& other) noexcept {
+                if (this != &other) {
+                    release();
+                    version = std::exchange(other.version, nullptr);
+                }
+                return *this;
+            }
+
+            ~Snapshot() {
+                release();
+            }
+
+            void release() noexcept {
+                if (version) { std::exchange(version, nullptr)->release(1); }
+            }
+
+            // nullptr if nothing had been published yet.
+            [[nodiscard]] const T* get() const noexcept {
+                return version ? version->value.get() : nullptr;
+            }
+
+            const T& operator*() const noexcept {
+                return *version->value;
+            }
+
+            const T* operator->() const noexcept {
+                return version->value.get();
+            }
+
+            explicit operator bool() const noexcept {
+                return version != nullptr;
+            }
+
+        private:
+            friend class SnapshotHolder;
+
+            explicit Snapshot(Version* version) noexcept : version(version) {}
+
+            Version* version = nullptr;
+        };
+
+        static constexpr size_t MaxVersions = 64;
+
+        SnapshotHolder() = default;
+
+        explicit SnapshotHolder(T initial) {
+            publish(std::move(initial));
+        }
+
+        SnapshotHolder(const SnapshotHolder&)            = delete;
+        SnapshotHolder& operator=(const SnapshotHolder&) = delete;
+
+        ~SnapshotHolder() {
+            retire(current.exchange(NoVersion, std::memory_order_acq_rel));
+        }
+
+        [[nodiscard]] Snapshot acquire() const noexcept {
+            const uint64_t word = current.fetch_add(OneAcquire, std::memory_order_acquire);
+            const auto slot     = static_cast<size_t>(word & SlotMask);
+            if (slot == NoVersion) { return Snapshot(); }
+            return Snapshot(versions[slot].load(std::memory_order_acquire));
+        }
+
+        // Makes `next` the version new snapshots see. Publishers are serialized; if
+        // `MaxVersions - 1` old versions are still held, this waits for one to be released.
+        void publish(T next) {
+            publish(std::make_unique<const T>(std::move(next)));
+        }
+
+        // For types that can't be moved, e.g. a LazyStylesheet that was parsed in place.
+        void publish(std::unique_ptr<const T> next) {
+            auto* version = new Version(std::move(next), this);
+
+            std::lock_guard lock(publishMutex);
+            version->slot = freeSlot();
+            versions[version->slot].store(version, std::memory_order_release);
+            retire(current.exchange(version->slot, std::memory_order_acq_rel));
+        }
+
+    private:
+        // `current` packs the slot of the current version (low bits) with the number of
+        // `acquire()` calls since it was published (high bits). A version's `references`
+        // starts at 0, drops with every release and is credited with that acquire count
+        // once the version is replaced; whoever brings it back to 0 destroys it.
+        static constexpr uint64_t SlotBits   = 8;
+        static constexpr uint64_t SlotMask   = (uint64_t {1} << SlotBits) - 1;
+        static constexpr uint64_t OneAcquire = uint64_t {1} << SlotBits;
+        static constexpr uint64_t NoVersion  = SlotMask;
+        static_assert(MaxVersions < NoVersion);
+
+        struct Version {
+            Version(std::unique_ptr<const T> value, SnapshotHolder* holder)
+                : value(std::move(value)), holder(holder) {}
+
+            void release(int64_t count) noexcept {
+                if (references.fetch_sub(count, std::memory_order_acq_rel) == count) {
+                    auto& slot = holder->versions[this->slot];
+                    delete this;
+                    slot.store(nullptr, std::memory_order_release);
+                }
+            }
+
+            std::unique_ptr<const T> value;
+            SnapshotHolder* holder;
+            size_t slot = 0;
+            std::atomic<int64_t> references = 0;
+        };
+
+        mutable std::atomic<uint64_t> current = NoVersion;
+        std::array<std::atomic<Version*>, MaxVersions> versions {};
+        std::mutex publishMutex;
+
+        // Hands the replaced version the acquires it received while it was current.
+        void retire(uint64_t word) noexcept {
+            const auto slot = static_cast<size_t>(word & SlotMask);
+            if (slot == NoVersion) { return; }
+
+            const auto acquires = static_cast<int64_t>(word >> SlotBits);
+            versions[slot].load(std::memory_order_acquire)->release(-acquires);
+        }
+
+        size_t freeSlot() const noexcept {
+            while (true) {
+                for (size_t slot = 0; slot < MaxVersions; slot++) {
+                    if (!versions[slot].load(std::memory_order_acquire)) { return slot; }
+                }
+                std::this_thread::yield();
+            }
+        }
+    };
+}  // namespace CSS
@@ -0,0 +1,75 @@
+// Runs patterns that used to make the lexer or parser super-linear (or not terminate) at
+// a few MiB each and fails if any parse mode is slower than its `CSS::Fuzz::MaxNanosPerByte`.
+//
+
+#include "Throughput.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <string>
+
+namespace {
+    constexpr size_t InputBytes = 4 * 1024 * 1024;
+    constexpr int Runs          = 3;  // the best run counts, to filter out scheduler noise
+
+    struct Pattern {
+        const char* name;
+        std::string unit;  // repeated up to `InputBytes`
+        std::string prefix = {};
+    };
+
+    std::string Repeat(const Pattern& pattern) {
+        std::string input = pattern.prefix;
+        input.reserve(InputBytes + pattern.unit.size());
+        while (input.size() < InputBytes) {
+            input += pattern.unit;
+        }
+        return input;
+    }
+}  // namespace
+
+int main() {
+    const Pattern patterns[] = {
+      {"open braces", "{"},
+      {"nested blocks", "a { { }"},
+      {"pound signs", "#", "a { b: "},
+      {"long hex color", "f", "a { b: #"},
+      {"quotes", "\""},
+      {"unterminated string", "x", "a { b: \""},
+      {"comment openers", "/*"},
+      {"unterminated comment", "x", "/*"},
+      {"unclosed blocks", "a { b: c; "},
+      {"bang without important", "a { b: c ! ; } "},
+      {"valid rules", "a { b: #08090E; c: 1 !important; d: \"e\"; }\n"},
+    };
+
+    bool ok = true;
+    for (const auto& pattern : patterns) {
+        const std::string input = Repeat(pattern);
+
+        printf("%-24s", pattern.name);
+        for (const auto mode : CSS::Fuzz::ParseModes) {
+            CSS::Fuzz::Measurement best = CSS::Fuzz::MeasureParse(input, mode);
+            for (int run = 1; run < Runs; run++) {
+                const auto measurement = CSS::Fuzz::MeasureParse(input, mode);
+                if (measurement.elapsed < best.elapsed) { best = measurement; }
+            }
+
+            const bool passed = best.nanosPerByte() <= CSS::Fuzz::MaxNanosPerByte(mode);
+            const char* verdict = passed ? "" : " FAIL";
+            printf(" %s %6.1f%s", CSS::Fuzz::Name(mode), best.nanosPerByte(), verdict);
+            if (!passed) {
+                fprintf(stderr,
+                        "%s: %s parse exceeded %.1f ns/byte\n",
+                        pattern.name,
+                        CSS::Fuzz::Name(mode),
+                        CSS::Fuzz::MaxNanosPerByte(mode));
+            }
+            ok = ok && passed;
+        }
+        printf("\n");
+    }
+
+    if (!ok) { return 1; }
+    return 0;
+}
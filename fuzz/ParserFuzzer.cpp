@@ -0,0 +1,31 @@
+// libFuzzer entry point. Crashes are found by the sanitizers; inputs that take super-linear
+// time abort with their measured throughput.
+//
+//   cmake -S . -B build-fuzz -DCMAKE_CXX_COMPILER=clang++ -DCSSPP_FUZZ=ON
+//   cmake --build build-fuzz --target ParserFuzzer && ./build-fuzz/ParserFuzzer
+//
+
+#include "Throughput.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    const std::string_view input(reinterpret_cast<const char*>(data), size);
+
+    for (const auto mode : CSS::Fuzz::ParseModes) {
+        const auto measurement = CSS::Fuzz::MeasureParse(input, mode);
+        if (!measurement.withinBound()) {
+            fprintf(stderr,
+                    "Parsing %zu bytes (%s) took %lld ns (%.1f ns/byte, bound %.1f ns/byte)\n",
+                    measurement.bytes,
+                    CSS::Fuzz::Name(mode),
+                    static_cast<long long>(measurement.elapsed.count()),
+                    measurement.nanosPerByte(),
+                    CSS::Fuzz::MaxNanosPerByte(mode));
+            std::abort();
+        }
+    }
+    return 0;
+}
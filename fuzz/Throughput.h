@@ -0,0 +1,103 @@
+// Shared by the libFuzzer harness and the adversarial-input driver: runs an input through
+// the parser and checks that the time spent stays linear in its size.
+//
+
+#pragma once
+
+#include <CSS.h>
+
+#include <array>
+#include <chrono>
+#include <string_view>
+
+namespace CSS::Fuzz {
+    // The parse modes that have their own loops: stop at the first error, recover past every
+    // error, the trusted-input policy and the lazy index.
+    enum class ParseMode { Strict, Recover, Trusted, Lazy };
+
+    inline constexpr std::array<ParseMode, 4> ParseModes = {
+      ParseMode::Strict,
+      ParseMode::Recover,
+      ParseMode::Trusted,
+      ParseMode::Lazy,
+    };
+
+    inline constexpr const char* Name(ParseMode mode) noexcept {
+        switch (mode) {
+            case ParseMode::Strict: return "strict";
+            case ParseMode::Recover: return "recover";
+            case ParseMode::Trusted: return "trusted";
+            case ParseMode::Lazy: return "lazy";
+        }
+        return "";
+    }
+
+    // Anything slower than this per input byte is treated as super-linear behavior. The
+    // slowest adversarial pattern measures ~35 ns/byte for the strict and trusted parsers,
+    // ~50 ns/byte when recovering (every error is re-synchronized and recorded) and ~8 ns/byte
+    // for the lazy index at -O2; each bound is about three times that.
+    inline constexpr double MaxNanosPerByte(ParseMode mode) noexcept {
+        switch (mode) {
+            case ParseMode::Strict: return 100.0;
+            case ParseMode::Recover: return 150.0;
+            case ParseMode::Trusted: return 100.0;
+            case ParseMode::Lazy: return 25.0;
+        }
+        return 0.0;
+    }
+
+    // Setup cost every input is allowed on top of the per-byte bound, so small inputs aren't
+    // judged on allocation and timer noise (nor on sanitizer overhead, which is what the
+    // fuzzer's inputs of a few KiB mostly measure).
+    inline constexpr std::chrono::nanoseconds FixedAllowance = std::chrono::milliseconds(5);
+
+    struct Measurement {
+        ParseMode mode = ParseMode::Strict;
+        std::chrono::nanoseconds elapsed {};
+        size_t bytes = 0;
+
+        [[nodiscard]] double nanosPerByte() const noexcept {
+            return bytes ? static_cast<double>(elapsed.count()) / static_cast<double>(bytes) : 0.0;
+        }
+
+        [[nodiscard]] bool withinBound() const noexcept {
+            const double bound =
+              static_cast<double>(FixedAllowance.count()) +
+              MaxNanosPerByte(mode) * static_cast<double>(bytes);
+            return static_cast<double>(elapsed.count()) <= bound;
+        }
+    };
+
+    inline Measurement MeasureParse(std::string_view input, ParseMode mode) {
+        const auto start = std::chrono::steady_clock::now();
+
+        switch (mode) {
+            case ParseMode::Strict: {
+                Parser parser(input);
+                parser.parse();
+                break;
+            }
+            case ParseMode::Recover: {
+                ParseOptions options;
+                options.recover = true;
+
+                Parser parser(input, std::move(options));
+                parser.parse();
+                break;
+            }
+            case ParseMode::Trusted: {
+                BasicParser<FastTrustedInputPolicy> parser(input);
+                parser.parse();
+                break;
+            }
+            case ParseMode::Lazy: {
+                LazyStylesheet lazy(input);
+                lazy.parse();
+                break;
+            }
+        }
+
+        const auto elapsed = std::chrono::steady_clock::now() - start;
+        return {mode, std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed), input.size()};
+    }
+}  // namespace CSS::Fuzz
@@ -37,5 +37,14 @@ int main() {
     CSS::Stylesheet stylesheet = parser.getStylesheet();
     CSS::PrintStylesheet(stylesheet);
 
+    // Serialized output must parse back into the same stylesheet.
+    const std::string text = CSS::SerializeStylesheet(stylesheet);
+    CSS::Parser reparser(text);
+    reparser.parse();
+    if (reparser.hadError || CSS::SerializeStylesheet(reparser.getStylesheet()) != text) {
+        std::cerr << "Round trip failed:\n" << text;
+        return -1;
+    }
+
     return 0;
 }